@@ -1,7 +1,117 @@
 #include <syscall.h>
 
+#include <stdbool.h>
+
 static char buffer[6];
 
+#if defined(INIT_BENCH) || defined(INIT_SELFTEST)
+
+#include <stats.h>
+
+/**
+ * A stats snapshot with only the header and the cpu records, the esp32
+ * has 2 cpus, aligned so it will never cross a page
+ */
+static uint8_t m_stats[sizeof(stats_header_t) + 2 * sizeof(stats_cpu_record_t)] __attribute__((aligned(512)));
+
+#endif
+
+#ifdef INIT_BENCH
+
+/**
+ * How many times to call each syscall when measuring it
+ */
+#define BENCH_ITERATIONS 1000
+
+static char m_bench_line[] = "fast: ........ cycles";
+
+static void log_cycles(const char* name, uint32_t cycles) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 4; i++) {
+        m_bench_line[i] = name[i];
+    }
+    for (int i = 0; i < 8; i++) {
+        m_bench_line[6 + i] = digits[(cycles >> (28 - i * 4)) & 0xF];
+    }
+    sys_log(m_bench_line, sizeof(m_bench_line) - 1);
+}
+
+/**
+ * Compare the syscall fast path to the slow one, get pid is served by
+ * the entry itself while the smallest stats snapshot goes through the
+ * full context save and the C handler, neither of them changes anything
+ */
+static void bench_syscalls() {
+    uint32_t start = sys_get_cycles();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        sys_get_pid();
+    }
+    log_cycles("fast", (sys_get_cycles() - start) / BENCH_ITERATIONS);
+
+    start = sys_get_cycles();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        sys_sched_stats(m_stats, sizeof(m_stats));
+    }
+    log_cycles("slow", (sys_get_cycles() - start) / BENCH_ITERATIONS);
+}
+
+#endif
+
+#ifdef INIT_SELFTEST
+
+static void selftest_log(const char* str, size_t size, bool ok) {
+    sys_log(str, size);
+    sys_log(ok ? "  ok" : "  FAILED", ok ? 4 : 8);
+}
+
+/**
+ * Setting an affinity that leaves out the cpu we run on must move us right
+ * away, even when nothing else wants this cpu, the affinity is set back to
+ * all the cpus once done
+ */
+static void selftest_affinity() {
+    static const char name[] = "affinity moves the task:";
+    int other = sys_get_cpu() == 0 ? 1 : 0;
+
+    sys_sched_set_affinity(SCHED_AFFINITY_CPU(other));
+    bool ok = sys_get_cpu() == other;
+    sys_sched_set_affinity(SCHED_AFFINITY_ALL);
+
+    selftest_log(name, sizeof(name) - 1, ok);
+}
+
+/**
+ * Long enough for the sleep to go through the higher levels of the timer wheel
+ */
+#define SELFTEST_SLEEP_US 5000000
+
+static uint32_t selftest_alarm_wakeups(int cpu) {
+    sys_sched_stats(m_stats, sizeof(m_stats));
+    stats_header_t* header = (stats_header_t*)m_stats;
+    stats_cpu_record_t* record = (stats_cpu_record_t*)(m_stats + header->header_size + cpu * header->cpu_record_size);
+    return record->stats.idle_alarm_wakeups;
+}
+
+/**
+ * A cpu that has nothing but a single far away sleeper must sleep right
+ * until it expires, so it wakes up for the alarm exactly once
+ */
+static void selftest_idle_wakeups() {
+    static const char name[] = "idle sleep wakes up once:";
+    int cpu = sys_get_cpu();
+
+    // stay on this cpu so the sleep is on its wheel
+    sys_sched_set_affinity(SCHED_AFFINITY_CPU(cpu));
+    uint32_t before = selftest_alarm_wakeups(cpu);
+    sys_sleep(SELFTEST_SLEEP_US);
+    bool ok = selftest_alarm_wakeups(cpu) - before == 1;
+    sys_sched_set_affinity(SCHED_AFFINITY_ALL);
+
+    selftest_log(name, sizeof(name) - 1, ok);
+}
+
+#endif
+
 void _start() {
     buffer[0] = 'H';
     buffer[1] = 'e';
@@ -10,5 +120,17 @@ void _start() {
     buffer[4] = 'o';
     buffer[5] = '!';
     sys_log(buffer, sizeof(buffer));
-    while(1);
+
+#ifdef INIT_BENCH
+    bench_syscalls();
+#endif
+
+#ifdef INIT_SELFTEST
+    selftest_affinity();
+    selftest_idle_wakeups();
+#endif
+
+    while(1) {
+        sys_sleep(1000000);
+    }
 }
@@ -10,4 +10,6 @@ typedef struct app_header {
     uint32_t data_size;
     uint32_t bss_size;
     uint32_t entry;
+    uint32_t priority;
+    uint32_t affinity;
 } app_header_t;
@@ -54,6 +54,16 @@ CFLAGS		+= -T$(APP_SHARED)/app.ld
 # Include the lib and kernel folders in include path
 CFLAGS 		+= -I$(APP_SHARED)
 
+# The priority the app starts with, put in the app header
+ifdef APP_PRIORITY
+CFLAGS 		+= -Wl,--defsym=APP_PRIORITY=$(APP_PRIORITY)
+endif
+
+# The cpus the app may start on, as a bitmask, put in the app header
+ifdef APP_AFFINITY
+CFLAGS 		+= -Wl,--defsym=APP_AFFINITY=$(APP_AFFINITY)
+endif
+
 #-----------------------------------------------------------------------------------------------------------------------
 # Target specific stuff
 #-----------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scheduler statistics
+//
+// The snapshot returned by sys_sched_stats is a stats_header_t, followed by cpu_count cpu records, then by
+// lock_count lock records and then by task_count task records. The size of each record is in the header, so
+// a reader built against an older version of this file can still walk the snapshot.
+//
+// All times are in cycles of the CCOUNT register, which are synced between the cpus on boot.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define STATS_VERSION 10
+
+/**
+ * The amount of buckets in the wakeup latency histogram, bucket i
+ * counts the wakeups that took [2^i, 2^(i+1)) cycles
+ */
+#define STATS_LATENCY_BUCKETS 32
+
+/**
+ * The per-task counters
+ */
+typedef struct task_stats {
+    // the cycles the task was running
+    uint64_t run_cycles;
+
+    // the cycles the task was runnable but waiting for a cpu
+    uint64_t wait_cycles;
+
+    // the task gave up the cpu, by parking or yielding
+    uint32_t voluntary_switches;
+
+    // the task was preempted
+    uint32_t involuntary_switches;
+
+    // the amount of jobs of an edf task that missed their deadline
+    uint32_t edf_misses;
+
+    // the times the task used all of its quota and had to
+    // wait for the next period
+    uint32_t quota_throttles;
+
+    // the times the task held a mutex that a more important
+    // task waited on, and inherited its priority
+    uint32_t priority_boosts;
+} task_stats_t;
+
+/**
+ * The per-cpu counters
+ */
+typedef struct cpu_stats {
+    // the cycles the cpu had nothing to run
+    uint64_t idle_cycles;
+
+    // the times the cpu ran out of work, and how many of
+    // those found work while spinning, without sleeping
+    uint32_t idle_entries;
+    uint32_t idle_spin_hits;
+
+    // the times the cpu slept and was woken up by the alarm, which
+    // is only set for the next timer or scheduling event
+    uint32_t idle_alarm_wakeups;
+
+    // the switches to a task whose address space was already
+    // bound to a pid on the cpu, and those that had to bind it
+    uint32_t pid_hits;
+    uint32_t pid_misses;
+
+    // the spaces that were bound ahead of time for the next task
+    // in the run queue, and the switches that were served by them
+    uint32_t pid_prebinds;
+    uint32_t pid_prebind_hits;
+
+    // the reschedules that would have picked the current task
+    // again, and returned right to it instead of switching
+    uint32_t same_task_returns;
+
+    // the times a task got the fpu and its state had to be loaded
+    uint32_t fpu_loads;
+
+    // histogram of the time it took from readying a task until it ran
+    uint32_t wakeup_latency[STATS_LATENCY_BUCKETS];
+} cpu_stats_t;
+
+typedef struct stats_header {
+    uint16_t version;
+    uint16_t header_size;
+
+    // the size of each of the records
+    uint16_t cpu_record_size;
+    uint16_t task_record_size;
+
+    // the amount of records
+    uint16_t cpu_count;
+    uint16_t task_count;
+
+    // the CCOUNT of the cpu that took the snapshot
+    uint32_t timestamp;
+
+    // the locks, only there if the kernel counts them
+    uint16_t lock_record_size;
+    uint16_t lock_count;
+
+    uint32_t _reserved;
+} stats_header_t;
+
+typedef struct stats_cpu_record {
+    cpu_stats_t stats;
+} stats_cpu_record_t;
+
+/**
+ * The counters of a single kernel spinlock
+ */
+typedef struct stats_lock_record {
+    // the address of the lock, to tell apart locks without a name
+    uint32_t address;
+    char name[12];
+
+    // the times the lock was taken, and how many of those had to wait
+    uint32_t acquisitions;
+    uint32_t contended;
+
+    // the cycles spent waiting for the lock
+    uint64_t spin_cycles;
+} stats_lock_record_t;
+
+typedef struct stats_task_record {
+    int32_t pid;
+    char name[16];
+    uint8_t status;
+    uint8_t priority;
+    uint8_t sched_class;
+    uint8_t _reserved;
+    task_stats_t stats;
+
+    // the cpu quota of the task in microseconds, and how much of
+    // it was used in the current period, the period is zero if
+    // the task has no quota
+    uint32_t quota_period;
+    uint32_t quota_budget;
+    uint32_t quota_used;
+} stats_task_record_t;
@@ -23,13 +23,42 @@ typedef enum syscall {
     SYSCALL_SCHED_PARK      = 0x08,
     SYSCALL_SCHED_YIELD     = 0x09,
     SYSCALL_SCHED_DROP      = 0x0a,
-    // 0x0b
-    // 0x0c
-    // 0x0d
-    // 0x0e
+    SYSCALL_SCHED_SET_PRIORITY = 0x0b,
+    SYSCALL_SCHED_SET_EDF   = 0x0c,
+    SYSCALL_SCHED_YIELD_TO  = 0x0d,
+    SYSCALL_GET_PID         = 0x0e,
     SYSCALL_LOG             = 0x0f,
+    SYSCALL_SCHED_STATS     = 0x10,
+    SYSCALL_SLEEP           = 0x11,
+    SYSCALL_SCHED_SET_AFFINITY = 0x12,
+    SYSCALL_SCHED_SET_QUOTA = 0x13,
+    SYSCALL_MUTEX_CREATE    = 0x14,
+    SYSCALL_MUTEX_DESTROY   = 0x15,
+    SYSCALL_MUTEX_LOCK      = 0x16,
+    SYSCALL_MUTEX_UNLOCK    = 0x17,
+    SYSCALL_GET_CYCLES      = 0x18,
+    SYSCALL_FUTEX_WAIT      = 0x19,
+    SYSCALL_FUTEX_WAKE      = 0x1a,
+    SYSCALL_GET_CPU         = 0x1b,
 } syscall_t;
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scheduling constants
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Task priorities, a lower value is more important
+ */
+#define SCHED_PRIORITY_HIGHEST  0
+#define SCHED_PRIORITY_LOWEST   31
+#define SCHED_PRIORITY_DEFAULT  16
+
+/**
+ * Affinity masks, bit i allows running on cpu i
+ */
+#define SCHED_AFFINITY_CPU(cpu) (1u << (cpu))
+#define SCHED_AFFINITY_ALL      0xFFFFFFFF
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Syscall helpers
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -40,6 +69,13 @@ static inline uint32_t syscall0(syscall_t syscall) {
     return a2;
 }
 
+static inline uint32_t syscall1(syscall_t syscall, size_t arg0) {
+    register int a2 asm("a2") = syscall;
+    register int a6 asm("a6") = arg0;
+    __asm__ volatile ("SYSCALL" : "+r"(a2) : "r"(a6) : "memory");
+    return a2;
+}
+
 static inline uint32_t syscall2(syscall_t syscall, size_t arg0, size_t arg1) {
     register int a2 asm("a2") = syscall;
     register int a6 asm("a6") = arg0;
@@ -48,6 +84,15 @@ static inline uint32_t syscall2(syscall_t syscall, size_t arg0, size_t arg1) {
     return a2;
 }
 
+static inline uint32_t syscall3(syscall_t syscall, size_t arg0, size_t arg1, size_t arg2) {
+    register int a2 asm("a2") = syscall;
+    register int a6 asm("a6") = arg0;
+    register int a3 asm("a3") = arg1;
+    register int a4 asm("a4") = arg2;
+    __asm__ volatile ("SYSCALL" : "+r"(a2) : "r"(a6), "r"(a3), "r"(a4) : "memory");
+    return a2;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Wrappers
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -64,6 +109,138 @@ static inline void sys_sched_drop() {
     syscall0(SYSCALL_SCHED_DROP);
 }
 
+/**
+ * Sleep for at least the given amount of microseconds,
+ * the resolution is a single millisecond
+ */
+static inline void sys_sleep(uint32_t us) {
+    syscall1(SYSCALL_SLEEP, us);
+}
+
+/**
+ * Switch directly to the task with the given pid, giving it the rest
+ * of our timeslice, fails if the task is not waiting to run or
+ * if it can't run on our cpu
+ */
+static inline int sys_sched_yield_to(int pid) {
+    return syscall1(SYSCALL_SCHED_YIELD_TO, pid);
+}
+
+static inline int sys_sched_set_priority(uint8_t priority) {
+    return syscall1(SYSCALL_SCHED_SET_PRIORITY, priority);
+}
+
+/**
+ * Set the cpus we may run on, an edf task must keep the cpu it was
+ * admitted to, an affinity set before moving to edf limits the
+ * cpus it can be admitted to
+ */
+static inline int sys_sched_set_affinity(uint32_t affinity) {
+    return syscall1(SYSCALL_SCHED_SET_AFFINITY, affinity);
+}
+
+/**
+ * Limit the cpu time we can use to budget microseconds in every period,
+ * once it is used up we will not run until the next period, a zero
+ * period removes the limit
+ */
+static inline int sys_sched_set_quota(uint32_t period, uint32_t budget) {
+    return syscall2(SYSCALL_SCHED_SET_QUOTA, period, budget);
+}
+
+/**
+ * Run as a periodic task, getting budget microseconds every period,
+ * each job must finish before deadline microseconds from its release,
+ * a job is finished by calling sys_sched_yield
+ */
+static inline int sys_sched_set_edf(uint32_t period, uint32_t budget, uint32_t deadline) {
+    return syscall3(SYSCALL_SCHED_SET_EDF, period, budget, deadline);
+}
+
+static inline int sys_get_pid() {
+    return syscall0(SYSCALL_GET_PID);
+}
+
+/**
+ * Get the CCOUNT of the cpu we run on, the cpus are synced on boot
+ * so it can be compared between tasks on different cpus
+ */
+static inline uint32_t sys_get_cycles() {
+    return syscall0(SYSCALL_GET_CYCLES);
+}
+
+/**
+ * Get the index of the cpu we run on, we might have moved by the time it returns
+ */
+static inline int sys_get_cpu() {
+    return syscall0(SYSCALL_GET_CPU);
+}
+
 static inline void sys_log(const char* str, size_t size) {
     syscall2(SYSCALL_LOG, (uintptr_t)str, size);
 }
+
+/**
+ * Take a snapshot of the scheduler statistics, see stats.h for the
+ * format, returns the amount of bytes written or a negative error
+ */
+static inline int sys_sched_stats(void* buffer, size_t size) {
+    return syscall2(SYSCALL_SCHED_STATS, (uintptr_t)buffer, size);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Mutexes
+//
+// Kernel mutexes with priority inheritance, while a task waits on a mutex the owner
+// runs with the priority of the waiter if it is more important
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Create a new mutex, returns the handle or a negative error
+ */
+static inline int sys_mutex_create() {
+    return syscall0(SYSCALL_MUTEX_CREATE);
+}
+
+static inline int sys_mutex_destroy(int handle) {
+    return syscall1(SYSCALL_MUTEX_DESTROY, handle);
+}
+
+static inline int sys_mutex_lock(int handle) {
+    return syscall1(SYSCALL_MUTEX_LOCK, handle);
+}
+
+static inline int sys_mutex_unlock(int handle) {
+    return syscall1(SYSCALL_MUTEX_UNLOCK, handle);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Futexes
+//
+// A futex is any aligned 32bit word in the data space, user locks change it with atomics (the kernel keeps
+// SCOMPARE1 for us) and only call the kernel to sleep when they are contended, or to wake the sleepers. Futexes
+// are matched by their physical address, so tasks that share a page can use them with each other.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The results of a wait
+ */
+#define FUTEX_WOKEN             0
+#define FUTEX_VALUE_CHANGED     1
+#define FUTEX_TIMED_OUT         2
+
+/**
+ * Sleep as long as the futex has the expected value, until someone wakes it or
+ * until timeout microseconds pass, 0 waits forever, a wait might end without
+ * a reason so the value must be checked again after it
+ */
+static inline int sys_futex_wait(uint32_t* addr, uint32_t expected, uint32_t timeout) {
+    return syscall3(SYSCALL_FUTEX_WAIT, (uintptr_t)addr, expected, timeout);
+}
+
+/**
+ * Wake up to count waiters of the futex, returns the amount that were woken
+ */
+static inline int sys_futex_wake(uint32_t* addr, uint32_t count) {
+    return syscall2(SYSCALL_FUTEX_WAKE, (uintptr_t)addr, count);
+}
@@ -2,11 +2,17 @@
 
 #include <drivers/pid.h>
 #include <task/task.h>
+#include <task/scheduler.h>
 
 #include <stdint.h>
 
 #define CPU_COUNT 2
 
+/**
+ * An affinity mask with all the cpus in it
+ */
+#define CPU_AFFINITY_ALL ((1u << CPU_COUNT) - 1)
+
 typedef struct per_cpu_context {
     //------------------------------
     // For PID management
@@ -28,9 +34,57 @@ typedef struct per_cpu_context {
     // how many disables we had
     int preempt_disable_depth;
 
+    // the local run queue of the cpu
+    run_queue_t run_queue;
+
+    // tasks that were readied for this cpu and were not yet put in
+    // its queues, pushed by anyone with S32C1I and only drained by
+    // the cpu itself
+    task_t* volatile wake_list;
+
+    // how many times in a row we passed over the head of the
+    // run queue for a task that is already bound on this cpu
+    uint32_t pid_affinity_skips;
+
+    // incremented on every schedule, used to
+    // check the global run queue for fairness
+    uint32_t sched_tick;
+
+    // the edf tasks admitted to this cpu, the ready ones sorted by
+    // deadline and the throttled ones sorted by their next release,
+    // protected by the run queue lock
+    task_queue_t edf_queue;
+    task_queue_t edf_throttled;
+
+    // the bandwidth admitted to this cpu
+    uint32_t edf_bw;
+
+    // when the current task started to run, in microseconds, only
+    // set for tasks that have a budget, edf or quota
+    uint64_t budget_start;
+
+    // the timeslice is not armed, the current task is
+    // running until something else becomes runnable
+    bool tick_stopped;
+
+    // the accounting of the cpu, and the CCOUNT of
+    // when the current task started to run
+    cpu_stats_t stats;
+    uint32_t exec_stamp;
+
+    // running average of the cycles from going idle
+    // until work showed up, to tune the idle spin
+    uint32_t idle_gap_avg;
+
+    // the timers armed on this cpu
+    timer_wheel_t timer_wheel;
+
     // the currently running task
     task_t* current_task;
 
+    // the task whose state is loaded in the fpu
+    task_t* fpu_owner;
+
     // callback to be called when parking
     void(*park_callback)(void* arg);
     void* park_arg;
@@ -41,6 +95,12 @@ typedef struct per_cpu_context {
  */
 extern per_cpu_context_t g_per_cpu_context[CPU_COUNT];
 
+/**
+ * The pid of the task running on each cpu, kept as a plain array
+ * so the syscall fast path can read it without going into C
+ */
+extern int32_t g_current_pid[CPU_COUNT];
+
 /**
  * The cpu context for the current cpu
  */
@@ -0,0 +1,91 @@
+#include "fpu.h"
+#include "intrin.h"
+#include "cpu.h"
+
+/**
+ * The fpu is coprocessor 0
+ */
+#define CPENABLE_FPU BIT0
+
+#define FPU_SAVE_REG(n) \
+    asm volatile ("ssi f" #n ", %0, %1" :: "r"(fpu->f), "i"((n) * 4) : "memory")
+
+#define FPU_LOAD_REG(n) \
+    asm volatile ("lsi f" #n ", %0, %1" :: "r"(fpu->f), "i"((n) * 4) : "memory")
+
+static void fpu_save_regs(task_fpu_t* fpu) {
+    FPU_SAVE_REG(0);
+    FPU_SAVE_REG(1);
+    FPU_SAVE_REG(2);
+    FPU_SAVE_REG(3);
+    FPU_SAVE_REG(4);
+    FPU_SAVE_REG(5);
+    FPU_SAVE_REG(6);
+    FPU_SAVE_REG(7);
+    FPU_SAVE_REG(8);
+    FPU_SAVE_REG(9);
+    FPU_SAVE_REG(10);
+    FPU_SAVE_REG(11);
+    FPU_SAVE_REG(12);
+    FPU_SAVE_REG(13);
+    FPU_SAVE_REG(14);
+    FPU_SAVE_REG(15);
+    asm volatile ("rur.fcr %0" : "=r"(fpu->fcr));
+    asm volatile ("rur.fsr %0" : "=r"(fpu->fsr));
+}
+
+static void fpu_load_regs(task_fpu_t* fpu) {
+    FPU_LOAD_REG(0);
+    FPU_LOAD_REG(1);
+    FPU_LOAD_REG(2);
+    FPU_LOAD_REG(3);
+    FPU_LOAD_REG(4);
+    FPU_LOAD_REG(5);
+    FPU_LOAD_REG(6);
+    FPU_LOAD_REG(7);
+    FPU_LOAD_REG(8);
+    FPU_LOAD_REG(9);
+    FPU_LOAD_REG(10);
+    FPU_LOAD_REG(11);
+    FPU_LOAD_REG(12);
+    FPU_LOAD_REG(13);
+    FPU_LOAD_REG(14);
+    FPU_LOAD_REG(15);
+    asm volatile ("wur.fcr %0" :: "r"(fpu->fcr));
+    asm volatile ("wur.fsr %0" :: "r"(fpu->fsr));
+}
+
+void fpu_disable() {
+    __WSR(CPENABLE, 0);
+    __rsync();
+}
+
+void fpu_save(task_t* task) {
+    // the fpu is only enabled once the task used it
+    if ((__RSR(CPENABLE) & CPENABLE_FPU) == 0) {
+        return;
+    }
+
+    fpu_save_regs(&task->fpu);
+}
+
+void fpu_handle_disabled(task_t* task) {
+    per_cpu_context_t* pctx = get_cpu_context();
+    uint32_t cpu_index = get_cpu_index();
+
+    // we need the fpu ourselves to switch its state
+    __WSR(CPENABLE, CPENABLE_FPU);
+    __rsync();
+
+    // the state of the task is still loaded from the last time it used
+    // the fpu on this cpu, it is only stale if it ran somewhere else since
+    if (pctx->fpu_owner == task && task->fpu_cpu == cpu_index) {
+        return;
+    }
+
+    // the previous owner was saved when it was switched out
+    fpu_load_regs(&task->fpu);
+    pctx->fpu_owner = task;
+    task->fpu_cpu = cpu_index;
+    pctx->stats.fpu_loads++;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <task/task.h>
+
+#include <stdbool.h>
+
+/**
+ * The fpu is switched lazily, a task starts every run with the fpu disabled
+ * and only gets it on the first use, by handling the Coprocessor0Disabled
+ * exception, so tasks that don't use floating point never pay for it.
+ *
+ * A task that used the fpu is saved when it is switched out, since it might
+ * run on the other cpu next, but its state is left loaded so if it is the
+ * next one to use the fpu on this cpu nothing has to be loaded.
+ */
+
+/**
+ * Disable the fpu for the task that is switched in
+ */
+void fpu_disable();
+
+/**
+ * Save the fpu state of the task that is switched out, if it used it
+ *
+ * @param task      [IN] The task that is switched out
+ */
+void fpu_save(task_t* task);
+
+/**
+ * Give the fpu to the task that tried to use it, loading its state
+ * unless it is still loaded in this cpu
+ *
+ * @param task      [IN] The current task
+ */
+void fpu_handle_disabled(task_t* task);
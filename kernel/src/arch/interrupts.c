@@ -3,6 +3,7 @@
 #include "task/task.h"
 #include "intrin.h"
 #include "cpu.h"
+#include "fpu.h"
 #include "drivers/timg.h"
 #include "task/scheduler.h"
 
@@ -106,6 +107,13 @@ static void print_opcodes(void* ptr, int32_t len) {
 void common_exception_handler(task_regs_t* regs) {
     int cause = __RSR(EXCCAUSE);
 
+    // first use of the fpu in this run of the task, give it
+    // the fpu and let it run the instruction again
+    if (cause == Coprocessor0Disabled && get_current_task() != NULL) {
+        fpu_handle_disabled(get_current_task());
+        return;
+    }
+
     wdt_disable();
 
     // print the cuase
@@ -154,10 +162,35 @@ void common_exception_handler(task_regs_t* regs) {
 }
 
 void common_interrupt_handler(task_regs_t* regs) {
-    // special case for scheduler
+    bool handled = false;
+    bool resched = false;
+
+    // acknowledge every source that is pending, not just the first
+    // one, otherwise the rest would take another exception each
+
+    // another cpu gave us a task that might be more
+    // important than the current one, reschedule
+    if (dport_handle_ipi()) {
+        handled = true;
+        resched = true;
+    }
+
+    if (alarm_handle()) {
+        handled = true;
+        resched = true;
+    }
+
+    // we are alive, nothing else to do
     if (wdt_handle()) {
-        scheduler_on_schedule(regs);
-    } else {
+        handled = true;
+    }
+
+    if (!handled) {
         dport_log_interrupt();
     }
+
+    // only switch once everything was handled
+    if (resched) {
+        scheduler_on_schedule(regs);
+    }
 }
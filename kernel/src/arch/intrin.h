@@ -55,3 +55,40 @@ static inline void __write_ps(ps_t ps) {
 static inline uint32_t __ccount() {
     return __RSR(CCOUNT);
 }
+
+//----------------------------------------------------------------------------------------------------------------------
+// Atomics and interrupt level
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Atomically compare the value at ptr with expected, and if they are equal
+ * store the new value, always returns the old value at ptr
+ */
+static inline uint32_t __s32c1i(volatile uint32_t* ptr, uint32_t expected, uint32_t new) {
+    __WSR(SCOMPARE1, expected);
+    asm volatile ("s32c1i %0, %1, 0" : "+r"(new) : "r"(ptr) : "memory");
+    return new;
+}
+
+/**
+ * Make sure all memory accesses before this are done before the ones after it
+ */
+static inline void __memw() {
+    asm volatile ("memw" ::: "memory");
+}
+
+/**
+ * Raise the interrupt level to mask all the interrupts, returns the old PS
+ */
+static inline uint32_t __rsil15() {
+    uint32_t ps;
+    asm volatile ("rsil %0, 15" : "=r"(ps) :: "memory");
+    return ps;
+}
+
+/**
+ * Restore the PS returned from __rsil15
+ */
+static inline void __restore_ps(uint32_t ps) {
+    asm volatile ("wsr %0, ps\n\trsync" :: "r"(ps) : "memory");
+}
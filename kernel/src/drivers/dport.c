@@ -1,6 +1,7 @@
 #include "dport.h"
 #include "pid.h"
 #include "arch/cpu.h"
+#include "arch/intrin.h"
 
 #include <util/defs.h>
 
@@ -44,6 +45,9 @@ extern volatile uint32_t DPORT_APP_BOOT_REMAP_CTRL;
 extern volatile uint32_t DPORT_CACHE_MUX_MODE;
 
 // Reset and clock registers
+extern volatile uint32_t DPORT_APPCPU_CTRL_REG_A;
+extern volatile uint32_t DPORT_APPCPU_CTRL_REG_B;
+extern volatile uint32_t DPORT_APPCPU_CTRL_REG_C;
 
 // Interrupt matrix registers
 extern volatile uint32_t DPORT_INTR_FROM_CPU[4];
@@ -145,11 +149,13 @@ void init_dport() {
 
 /**
  * Free peripheral interrupts (both edge and level) that are
- * only priority level 1
+ * only priority level 1, each cpu has its own set of interrupts
  */
-uint32_t m_free_peripheral_interrupt =
+uint32_t m_free_peripheral_interrupt[CPU_COUNT] = {
+    [0 ... CPU_COUNT - 1] =
         BIT0 | BIT1 | BIT2 | BIT3 | BIT4 | BIT5 | BIT8 |
-        BIT9 | BIT10 | BIT12 | BIT13 | BIT17 | BIT18;
+        BIT9 | BIT10 | BIT12 | BIT13 | BIT17 | BIT18
+};
 
 err_t dport_map_interrupt(interrupt_source_t source, bool edge_triggered) {
     err_t err = NO_ERROR;
@@ -159,7 +165,8 @@ err_t dport_map_interrupt(interrupt_source_t source, bool edge_triggered) {
     CHECK(source <= 68);
 
     // mask properly and make sure there are enough of these
-    uint32_t free_peripheral_interrupt = m_free_peripheral_interrupt;
+    uint32_t cpu = get_cpu_index();
+    uint32_t free_peripheral_interrupt = m_free_peripheral_interrupt[cpu];
     if (edge_triggered) {
         free_peripheral_interrupt &= PERIPHERALS_EDGE_TRIGGERED;
     } else {
@@ -169,21 +176,30 @@ err_t dport_map_interrupt(interrupt_source_t source, bool edge_triggered) {
 
     // allocate the first available one
     uint32_t free = __builtin_ffs(free_peripheral_interrupt) - 1;
-    m_free_peripheral_interrupt &= ~(1 << free);
+    m_free_peripheral_interrupt[cpu] &= ~(1 << free);
 
-    TRACE("Mapping %d -> %d", source, free);
+    TRACE("Mapping %d -> %d (CPU%d)", source, free, cpu);
 
     // map it properly
-    DPORT_PRO_INT_MAP[source] = free;
+    if (cpu == 0) {
+        DPORT_PRO_INT_MAP[source] = free;
+    } else {
+        DPORT_APP_INT_MAP[source] = free;
+    }
+
+    // and enable it
+    __WSR(INTENABLE, __RSR(INTENABLE) | (1 << free));
+    __rsync();
 
 cleanup:
     return err;
 }
 
 void dport_log_interrupt() {
+    volatile uint32_t* status = get_cpu_index() == 0 ? DPORT_PRO_INTR_STATUS : DPORT_APP_INTR_STATUS;
     TRACE("Interrupts:");
     for (int i = 0; i < INTERRUPT_SOURCE_MAX; i++) {
-        if (DPORT_PRO_INTR_STATUS[i / 32] & (1 << (i % 32))) {
+        if (status[i / 32] & (1 << (i % 32))) {
             switch (i) {
                 default: WARN("\tGot interrupt: #%d", i); break;
             }
@@ -191,6 +207,63 @@ void dport_log_interrupt() {
     }
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Cross-core interrupts
+//----------------------------------------------------------------------------------------------------------------------
+
+err_t dport_init_ipi() {
+    err_t err = NO_ERROR;
+
+    // each cpu gets the cross-core interrupt matching its index
+    uint32_t cpu = get_cpu_index();
+    DPORT_INTR_FROM_CPU[cpu] = 0;
+    CHECK_AND_RETHROW(dport_map_interrupt(FROM_CPU_INTR0 + cpu, false));
+
+cleanup:
+    return err;
+}
+
+void dport_send_ipi(uint32_t cpu) {
+    DPORT_INTR_FROM_CPU[cpu] = 1;
+}
+
+bool dport_handle_ipi() {
+    uint32_t cpu = get_cpu_index();
+
+    // check if we got one
+    if (!DPORT_INTR_FROM_CPU[cpu]) {
+        return false;
+    }
+
+    // the interrupt is level-triggered, clear it
+    DPORT_INTR_FROM_CPU[cpu] = 0;
+
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// APP cpu control
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Sets the address that the APP cpu is going to jump to
+ * once it is out of reset, provided by the bootrom
+ */
+void ets_set_appcpu_boot_addr(uint32_t addr);
+
+void dport_start_app_cpu(void* entry) {
+    // enable the clock and make sure it is not stalled
+    DPORT_APPCPU_CTRL_REG_B |= BIT0;
+    DPORT_APPCPU_CTRL_REG_C &= ~BIT0;
+
+    // reset it
+    DPORT_APPCPU_CTRL_REG_A |= BIT0;
+    DPORT_APPCPU_CTRL_REG_A &= ~BIT0;
+
+    // and let the bootrom jump to the entry
+    ets_set_appcpu_boot_addr((uint32_t)entry);
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // MMU/MPU stuff
 //----------------------------------------------------------------------------------------------------------------------
@@ -228,6 +301,28 @@ STATIC_ASSERT(0x32C + MPU_I2S1 * 4 == 0x3c8);
 STATIC_ASSERT(0x32C + MPU_UART2 * 4 == 0x3cc);
 STATIC_ASSERT(0x32C + MPU_PWR * 4 == 0x3e4);
 
+/**
+ * The hardware tables are shared between the cpus and reading them back is slow, so
+ * we keep two copies in ram, the staged one is what we want the tables to hold and
+ * the shadow is what they hold right now, changes are done to the staged tables and
+ * mmu_commit only writes the words that actually differ.
+ *
+ * The dirty masks mark words whose shadow can't be trusted, they are written on the
+ * next commit even if the staged word is the same.
+ *
+ * All of this is protected by the pid bind lock.
+ */
+static uint32_t m_immu_staged[16];
+static uint32_t m_immu_shadow[16];
+static uint32_t m_dmmu_staged[16];
+static uint32_t m_dmmu_shadow[16];
+static uint32_t m_mpu_staged[MPU_LAST];
+static uint32_t m_mpu_shadow[MPU_LAST];
+static uint16_t m_immu_dirty;
+static uint16_t m_dmmu_dirty;
+static uint64_t m_mpu_dirty;
+STATIC_ASSERT(MPU_LAST <= 64);
+
 err_t init_mmu() {
     err_t err = NO_ERROR;
 
@@ -236,10 +331,27 @@ err_t init_mmu() {
     DPORT_IMMU_PAGE_MODE = 0;
     DPORT_DMMU_PAGE_MODE = 0;
 
+    // start with all the pages owned by the kernel, so we know
+    // exactly what the tables hold
+    for (int i = 0; i < 16; i++) {
+        DPORT_IMMU_TABLE[i].packed = 0;
+        DPORT_DMMU_TABLE[i].packed = 0;
+    }
+
     // setup the vdso page, it is always mapped at the last page
     // of the usermode area, and is available to all the pages
-    DPORT_IMMU_TABLE[15].address = 15;
-    DPORT_IMMU_TABLE[15].access_rights = 1;
+    DPORT_IMMU_TABLE[15].packed = (DPORT_MMU_TABLE_REG){ .address = 15, .access_rights = 1 }.packed;
+
+    for (int i = 0; i < 16; i++) {
+        m_immu_shadow[i] = m_immu_staged[i] = DPORT_IMMU_TABLE[i].packed;
+        m_dmmu_shadow[i] = m_dmmu_staged[i] = DPORT_DMMU_TABLE[i].packed;
+    }
+
+    // the peripheral table is read once, it might have
+    // access bits for the kernel pids
+    for (int i = 0; i < MPU_LAST; i++) {
+        m_mpu_shadow[i] = m_mpu_staged[i] = DPORT_AHBLITE_MPU_TABLE[i];
+    }
 
     // no DMA is allowed for now
     for (int i = 0; i < 2; i++) {
@@ -254,6 +366,10 @@ void mmu_activate(mmu_t* space) {
     ASSERT(space != NULL);
     per_cpu_context_t* context = get_cpu_context();
 
+    // the other cpu might take the space from one of our
+    // bindings while we look at them
+    pid_bindings_lock();
+
     // check if we have a binding for this space already
     int lru_pid = 0;
     for (int i = 0; i < PID_BINDING_COUNT; i++) {
@@ -264,7 +380,8 @@ void mmu_activate(mmu_t* space) {
                 // not the current want, move to it
                 pid_binding_rebind(&context->pid_bindings[i]);
             }
-            return;
+            context->pid_bindings[i].prebound = false;
+            goto cleanup;
         }
 
         // choose the LRU bindings
@@ -275,11 +392,54 @@ void mmu_activate(mmu_t* space) {
 
     // we need to bind a new space, use the one we found
     pid_binding_bind(&context->pid_bindings[lru_pid], space);
+
+cleanup:
+    pid_bindings_unlock();
+}
+
+bool mmu_prebind(mmu_t* space) {
+    ASSERT(space != NULL);
+    per_cpu_context_t* context = get_cpu_context();
+    bool bound = false;
+
+    pid_bindings_lock();
+
+    // find a free binding, or the LRU one, but never
+    // the one we are about to run with
+    int victim = -1;
+    for (int i = 0; i < PID_BINDING_COUNT; i++) {
+        pid_binding_t* binding = &context->pid_bindings[i];
+        if (binding->bound_space == space) {
+            goto cleanup;
+        }
+
+        if (pid_binding_is_primary(binding)) {
+            continue;
+        }
+
+        if (victim == -1) {
+            victim = i;
+        } else if (context->pid_bindings[victim].bound_space != NULL) {
+            if (binding->bound_space == NULL || binding->primary_stamp < context->pid_bindings[victim].primary_stamp) {
+                victim = i;
+            }
+        }
+    }
+
+    if (victim == -1) {
+        goto cleanup;
+    }
+
+    pid_binding_prebind(&context->pid_bindings[victim], space);
+    bound = true;
+
+cleanup:
+    pid_bindings_unlock();
+    return bound;
 }
 
 err_t mmu_map(mmu_t* mmu, mmu_space_type_t type, uint8_t virt, page_entry_t entry) {
     err_t err = NO_ERROR;
-    int bit = (1 << virt);
 
     CHECK(virt < MAX_PAGE_COUNT);
 
@@ -287,64 +447,106 @@ err_t mmu_map(mmu_t* mmu, mmu_space_type_t type, uint8_t virt, page_entry_t entr
     mmu_space_t* space = type == MMU_SPACE_CODE ? &mmu->immu : &mmu->dmmu;
     space->entries[virt] = entry;
 
-    // if the process is running, update the mmu itself
-    if (entry.type == PAGE_MAPPED && pid_binding_is_primary(mmu->binding)) {
-        volatile DPORT_MMU_TABLE_REG* table_reg = &DPORT_IMMU_TABLE[entry.phys];
-        table_reg->address = virt;
-        table_reg->access_rights = mmu->binding->pid;
-    }
+    // if the space is bound, update the mmu itself
+    pid_binding_update(mmu);
 
 cleanup:
     return err;
 }
 
+/**
+ * Remove everything that the given pid has from the staged tables
+ */
+static void mmu_stage_clear(int pid) {
+    for (int i = 0; i < 16; i++) {
+        if (((DPORT_MMU_TABLE_REG){ .packed = m_immu_staged[i] }).access_rights == pid) {
+            m_immu_staged[i] = 0;
+        }
+
+        if (((DPORT_MMU_TABLE_REG){ .packed = m_dmmu_staged[i] }).access_rights == pid) {
+            m_dmmu_staged[i] = 0;
+        }
+    }
+
+    for (int i = 0; i < MPU_LAST; i++) {
+        m_mpu_staged[i] &= ~(1 << pid);
+    }
+}
+
 void mmu_load(mmu_t* space) {
     int pid = space->binding->pid;
 
+    // the space might have changed since the pid last had it
+    mmu_stage_clear(pid);
+
     // go over the mmu entries
     for (int virt = 0; virt < 16; virt++) {
         // set the iram
         if (space->immu.entries[virt].type == PAGE_MAPPED) {
             uint8_t phys = space->immu.entries[virt].phys;
-            DPORT_IMMU_TABLE[phys].address = virt;
-            DPORT_IMMU_TABLE[phys].access_rights = pid;
+            m_immu_staged[phys] = (DPORT_MMU_TABLE_REG){ .address = virt, .access_rights = pid }.packed;
         }
 
         // set the dram
         if (space->dmmu.entries[virt].type == PAGE_MAPPED) {
             uint8_t phys = space->dmmu.entries[virt].phys;
-            DPORT_DMMU_TABLE[phys].address = virt;
-            DPORT_DMMU_TABLE[phys].access_rights = pid;
+            m_dmmu_staged[phys] = (DPORT_MMU_TABLE_REG){ .address = virt, .access_rights = pid }.packed;
         }
     }
 
     // set the peripheral access for the pid
     FOR_EACH_BIT(space->mpu_peripheral, it) {
-        DPORT_AHBLITE_MPU_TABLE[1 << it] = 1 << pid;
+        if (it < MPU_LAST) {
+            m_mpu_staged[it] |= 1 << pid;
+        }
     }
 }
 
 void mmu_unload(mmu_t* space) {
+    mmu_stage_clear(space->binding->pid);
+}
+
+void mmu_invalidate(mmu_t* space) {
     int pid = space->binding->pid;
 
-    // go over the mmu entries
-    // TODO: do we want to have a mapped check instead maybe?
-    //       I am not sure if it would be faster than just
-    //       reading the access rights instead...
     for (int i = 0; i < 16; i++) {
-        // remove anything in dram that has this bit
-        if (DPORT_IMMU_TABLE[i].access_rights == pid) {
-            DPORT_IMMU_TABLE[i].access_rights = 0;
+        if (((DPORT_MMU_TABLE_REG){ .packed = m_immu_shadow[i] }).access_rights == pid) {
+            m_immu_dirty |= 1 << i;
         }
 
-        // remove anything in iram that has this bit
-        if (DPORT_DMMU_TABLE[i].access_rights == pid) {
-            DPORT_DMMU_TABLE[i].access_rights = 0;
+        if (((DPORT_MMU_TABLE_REG){ .packed = m_dmmu_shadow[i] }).access_rights == pid) {
+            m_dmmu_dirty |= 1 << i;
         }
     }
 
-    // remove the peripheral access for the pid
-    FOR_EACH_BIT(space->mpu_peripheral, it) {
-        DPORT_AHBLITE_MPU_TABLE[1 << it] &= ~(1 << pid);
+    for (int i = 0; i < MPU_LAST; i++) {
+        if (m_mpu_shadow[i] & (1 << pid)) {
+            m_mpu_dirty |= 1ull << i;
+        }
     }
 }
+
+void mmu_commit() {
+    for (int i = 0; i < 16; i++) {
+        if (m_immu_staged[i] != m_immu_shadow[i] || (m_immu_dirty & (1 << i))) {
+            DPORT_IMMU_TABLE[i].packed = m_immu_staged[i];
+            m_immu_shadow[i] = m_immu_staged[i];
+        }
+
+        if (m_dmmu_staged[i] != m_dmmu_shadow[i] || (m_dmmu_dirty & (1 << i))) {
+            DPORT_DMMU_TABLE[i].packed = m_dmmu_staged[i];
+            m_dmmu_shadow[i] = m_dmmu_staged[i];
+        }
+    }
+
+    for (int i = 0; i < MPU_LAST; i++) {
+        if (m_mpu_staged[i] != m_mpu_shadow[i] || (m_mpu_dirty & (1ull << i))) {
+            DPORT_AHBLITE_MPU_TABLE[i] = m_mpu_staged[i];
+            m_mpu_shadow[i] = m_mpu_staged[i];
+        }
+    }
+
+    m_immu_dirty = 0;
+    m_dmmu_dirty = 0;
+    m_mpu_dirty = 0;
+}
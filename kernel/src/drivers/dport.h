@@ -32,7 +32,10 @@ typedef enum interrupt_source {
     TG1_LACT_LEVEL_INT = 21,
     GPIO_INTERRUPT = 22,
     GPIO_INTERRUPT_NMI = 23,
-    // ...
+    FROM_CPU_INTR0 = 24,
+    FROM_CPU_INTR1 = 25,
+    FROM_CPU_INTR2 = 26,
+    FROM_CPU_INTR3 = 27,
     SPI_INTR_0 = 28,
     SPI_INTR_1 = 29,
     SPI_INTR_2 = 30,
@@ -55,7 +58,7 @@ typedef enum interrupt_source {
  * Map an interrupt, getting back the interrupt number
  *
  * @remark
- * Always allocates to the PRO cpu
+ * Always allocates to the current cpu, and enables the interrupt on it
  *
  * @param source            [IN]    The interrupt source
  * @param edge_triggered    [IN]    Should this be an edge-triggered interrupt, otherwise level interrupt
@@ -64,6 +67,39 @@ err_t dport_map_interrupt(interrupt_source_t source, bool edge_triggered);
 
 void dport_log_interrupt();
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Cross-core interrupts
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Map the cross-core interrupt of the current cpu
+ */
+err_t dport_init_ipi();
+
+/**
+ * Send a cross-core interrupt to the given cpu
+ *
+ * @param cpu   [IN] The cpu to interrupt
+ */
+void dport_send_ipi(uint32_t cpu);
+
+/**
+ * Check and acknowledge a cross-core interrupt sent to the
+ * current cpu, returns true if there was one
+ */
+bool dport_handle_ipi();
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// APP cpu control
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Take the APP cpu out of reset and have it start at the given entry
+ *
+ * @param entry [IN] The entry point of the APP cpu
+ */
+void dport_start_app_cpu(void* entry);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // MMU/MPU abstraction
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -204,11 +240,32 @@ err_t mmu_map(mmu_t* mmu, mmu_space_type_t type, uint8_t virt, page_entry_t entr
 void mmu_activate(mmu_t* space);
 
 /**
- * Load the MMU entries
+ * Bind the given MMU range to a spare pid of the current cpu ahead of time, so
+ * activating it later is cheap, returns false if it was already bound or
+ * there is no spare pid
+ */
+bool mmu_prebind(mmu_t* space);
+
+/**
+ * Stage the MMU entries of the space for its bound pid, replacing
+ * whatever the pid had before
  */
 void mmu_load(mmu_t* space);
 
 /**
- * Unload MMU entries for the bound pid
+ * Stage the removal of the MMU entries for the bound pid
  */
 void mmu_unload(mmu_t* space);
+
+/**
+ * Don't trust the shadow of the entries that the bound pid has, they are
+ * written again on the next commit even if they did not change, used when
+ * the space is taken from the other cpu while it might be running with it
+ */
+void mmu_invalidate(mmu_t* space);
+
+/**
+ * Write the staged MMU entries to the hardware, only the entries that
+ * changed since the last commit, or were invalidated, are written
+ */
+void mmu_commit();
@@ -3,8 +3,13 @@
 
 #include <arch/intrin.h>
 
+#include <util/spinlock.h>
 #include <util/trace.h>
 
+// protects binding spaces, since a space can move between the
+// cpus and the mmu tables are shared between them
+static irq_spinlock_t m_bind_lock = INIT_NAMED_IRQ_SPINLOCK("pid_bind");
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Hardware registers
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -52,10 +57,11 @@ void init_pid() {
     // set the delay, this was calculated exactly as needed
     PIDCTRL_PID_DELAY = 0;
 
-    // setup the pids
+    // setup the pids, each cpu gets its own range of
+    // pids since the mmu tables are shared between them
     pid_binding_t* binding = get_cpu_context()->pid_bindings;
     for (int i = 0; i < PID_BINDING_COUNT; i++) {
-        binding[i].pid = i + 2;
+        binding[i].pid = 2 + get_cpu_index() * PID_BINDING_COUNT + i;
     }
 }
 
@@ -67,6 +73,14 @@ __attribute__((noinline)) void pid_prepare() {
     PIDCTRL_PID_NEW_REG = current_pid;
 }
 
+void pid_bindings_lock() {
+    irq_spinlock_lock(&m_bind_lock);
+}
+
+void pid_bindings_unlock() {
+    irq_spinlock_unlock(&m_bind_lock);
+}
+
 bool pid_binding_is_primary(pid_binding_t* binding) {
     return binding != NULL && get_cpu_context()->primary_binding == binding;
 }
@@ -79,8 +93,11 @@ void pid_binding_rebind(pid_binding_t* binding) {
     context->primary_binding = binding;
 }
 
-void pid_binding_bind(pid_binding_t* binding, mmu_t* space) {
-    per_cpu_context_t* context = get_cpu_context();
+/**
+ * Load the space into the binding, replacing whatever was bound to it,
+ * must be called with the bind lock held
+ */
+static void pid_binding_load(pid_binding_t* binding, mmu_t* space) {
     mmu_t* unbound_space = binding->bound_space;
 
     // set the new space
@@ -89,17 +106,58 @@ void pid_binding_bind(pid_binding_t* binding, mmu_t* space) {
     // remove the entries of the old state
     if (unbound_space != NULL) {
         mmu_unload(unbound_space);
+        unbound_space->binding = NULL;
     }
 
-    // set the entries of the new state
+    // the space might still be bound on the other cpu, a space can
+    // only have a single pid at a time so take it from there, and
+    // rewrite everything the other pid had instead of trusting the
+    // shadow for the entries of a pid that was in use elsewhere
+    if (space->binding != NULL) {
+        mmu_invalidate(space);
+        pid_binding_unbind(space->binding);
+    }
+
+    // set the entries of the new state, the entries of
+    // the old space that got reused are only written once
     space->binding = binding;
     mmu_load(space);
+    mmu_commit();
+}
+
+void pid_binding_bind(pid_binding_t* binding, mmu_t* space) {
+    per_cpu_context_t* context = get_cpu_context();
+
+    pid_binding_load(binding, space);
+    binding->prebound = false;
 
     // set the primary space and the binding stamp
     binding->primary_stamp = context->next_stamp++;
     context->primary_binding = binding;
 }
 
+void pid_binding_prebind(pid_binding_t* binding, mmu_t* space) {
+    per_cpu_context_t* context = get_cpu_context();
+
+    pid_binding_load(binding, space);
+    binding->prebound = true;
+
+    // stamp it so it will not be the first to go on the next
+    // miss, but don't make it primary
+    binding->primary_stamp = context->next_stamp++;
+}
+
+void pid_binding_update(mmu_t* space) {
+    irq_spinlock_lock(&m_bind_lock);
+
+    if (space->binding != NULL) {
+        mmu_load(space);
+        mmu_commit();
+    }
+
+    irq_spinlock_unlock(&m_bind_lock);
+}
+
 void pid_binding_unbind(pid_binding_t* binding) {
     // remove the entries for this space
     mmu_unload(binding->bound_space);
@@ -107,4 +165,5 @@ void pid_binding_unbind(pid_binding_t* binding) {
 
     // set the unbound space
     binding->bound_space = NULL;
+    binding->prebound = false;
 }
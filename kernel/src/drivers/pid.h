@@ -6,9 +6,11 @@
 #include <stdbool.h>
 
 /**
- * The amount of free pid entries
+ * The amount of free pid entries per cpu, the hardware has 6 pids
+ * that can be used by usermode, and since the MMU is shared between
+ * the cpus we are splitting them evenly
  */
-#define PID_BINDING_COUNT 6
+#define PID_BINDING_COUNT 3
 
 /**
  * Represent a pid cache
@@ -22,6 +24,10 @@ typedef struct pid_binding {
 
     // the hardware pid for this
     uint8_t pid;
+
+    // the space was bound ahead of time, and was
+    // not switched to since
+    bool prebound;
 } pid_binding_t;
 
 /**
@@ -38,6 +44,18 @@ void init_pid();
  */
 void pid_prepare();
 
+/**
+ * Lock the bindings of all the cpus, a bind on one cpu can take the
+ * space from a binding of the other, so anything that looks at the
+ * bound spaces or at the binding of a space must hold it
+ */
+void pid_bindings_lock();
+
+/**
+ * Unlock the bindings of all the cpus
+ */
+void pid_bindings_unlock();
+
 /**
  * Checks if this pid binding is the currently bound one
  */
@@ -49,11 +67,27 @@ bool pid_binding_is_primary(pid_binding_t* binding);
 void pid_binding_rebind(pid_binding_t* binding);
 
 /**
- * Bind a new space to the given binding
+ * Bind a new space to the given binding, must be called with the
+ * bindings locked
  */
 void pid_binding_bind(pid_binding_t* binding, mmu_t* space);
 
 /**
- * Unbind the space from the given binding
+ * Bind a new space to the given binding ahead of time, without making
+ * it the current one, switching to it later only needs a rebind, must
+ * be called with the bindings locked
+ */
+void pid_binding_prebind(pid_binding_t* binding, mmu_t* space);
+
+/**
+ * Reload the entries of a space after it was changed, does
+ * nothing if the space is not bound
+ */
+void pid_binding_update(mmu_t* space);
+
+/**
+ * Unbind the space from the given binding, the tables are
+ * only written on the next commit, must be called with the
+ * bindings locked
  */
 void pid_binding_unbind(pid_binding_t* binding);
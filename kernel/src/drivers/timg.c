@@ -2,6 +2,7 @@
 #include "util/trace.h"
 #include "util/except.h"
 #include "dport.h"
+#include "arch/cpu.h"
 
 #include <util/defs.h>
 
@@ -84,30 +85,166 @@ extern volatile TIMG_INT_REG TIMG0_INT_ST;
 extern volatile TIMG_INT_REG TIMG0_INT_CLR;
 
 /* Timer group 1 */
-// TODO: if needed
+extern volatile TIMG_REG TIMG1[2];
+extern volatile TIMG_WDTCONFIG_REG TIMG1_WDTCONFIG;
+extern volatile uint32_t TIMG1_WDTCONFIG1;
+extern volatile uint32_t TIMG1_WDTCONFIG2;
+extern volatile uint32_t TIMG1_WDTCONFIG3;
+extern volatile uint32_t TIMG1_WDTCONFIG4;
+extern volatile uint32_t TIMG1_WDTCONFIG5;
+extern volatile uint32_t TIMG1_WDTFEED;
+extern volatile uint32_t TIMG1_WDTWPROTECT;
+extern volatile TIMG_INT_REG TIMG1_INT_ENA;
+extern volatile TIMG_INT_REG TIMG1_INT_RAW;
+extern volatile TIMG_INT_REG TIMG1_INT_ST;
+extern volatile TIMG_INT_REG TIMG1_INT_CLR;
+
+/**
+ * Each cpu has its own timer group for the watchdog, the
+ * PRO cpu uses timer group 0 and the APP cpu uses timer group 1
+ */
+#define TIMG_CPU(reg) (*(get_cpu_index() == 0 ? &TIMG0_##reg : &TIMG1_##reg))
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Implementation
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+//----------------------------------------------------------------------------------------------------------------------
+// System timer
+//----------------------------------------------------------------------------------------------------------------------
+
+void init_systimer() {
+    // count up in microseconds
+    TIMG_CONFIG_REG config = {
+        .divider = APB_FREQ_HZ / 1000000,
+        .increase = 1,
+    };
+    TIMG1[0].config = config;
+
+    // start from zero
+    TIMG1[0].loadlo = 0;
+    TIMG1[0].loadhi = 0;
+    TIMG1[0].load = 1;
+
+    // and start it
+    TIMG1[0].config.en = 1;
+}
+
+uint64_t systimer_now() {
+    uint32_t hi, lo;
+
+    // latch the current value and read it, the latch is shared with
+    // the other cpu so it might latch again between our reads, if the
+    // high part stayed the same the low part still matches it
+    do {
+        TIMG1[0].update = 1;
+        hi = TIMG1[0].hi;
+        lo = TIMG1[0].lo;
+    } while (hi != TIMG1[0].hi);
+
+    return ((uint64_t)hi << 32) | lo;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Alarm
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Each cpu has its own timer in timer group 0 for the alarm
+ */
+#define TIMG_ALARM (TIMG0[get_cpu_index()])
+
+err_t init_alarm() {
+    err_t err = NO_ERROR;
+
+    // allocate an interrupt for the alarm of the current cpu
+    CHECK_AND_RETHROW(dport_map_interrupt(get_cpu_index() == 0 ? TG_T0_LEVEL_INT : TG_T1_LEVEL_INT, false));
+
+    // count up in microseconds, the alarm is
+    // only enabled once we set it
+    TIMG_CONFIG_REG config = {
+        .level_int_en = 1,
+        .divider = APB_FREQ_HZ / 1000000,
+        .increase = 1,
+    };
+    TIMG_ALARM.config = config;
+    TIMG_ALARM.loadlo = 0;
+    TIMG_ALARM.loadhi = 0;
+    TIMG_ALARM.alarmhi = 0;
+    TIMG_ALARM.config.en = 1;
+
+    // enable the interrupt of the alarm, and clear it
+    if (get_cpu_index() == 0) {
+        TIMG0_INT_ENA.t0_int = 1;
+        TIMG0_INT_CLR.t0_int = 1;
+    } else {
+        TIMG0_INT_ENA.t1_int = 1;
+        TIMG0_INT_CLR.t1_int = 1;
+    }
+
+cleanup:
+    return err;
+}
+
+void alarm_set(uint32_t us) {
+    // restart the counter from zero, the high bits of
+    // the load and alarm values are always zero
+    TIMG_ALARM.load = 1;
+    TIMG_ALARM.alarmlo = us;
+
+    // the hardware clears it once the alarm fires
+    TIMG_ALARM.config.alarm_en = 1;
+}
+
+void alarm_cancel() {
+    TIMG_ALARM.config.alarm_en = 0;
+
+    // make sure an alarm that already fired
+    // will not wake us up later on
+    alarm_handle();
+}
+
+bool alarm_handle() {
+    if (get_cpu_index() == 0) {
+        if (!TIMG0_INT_ST.t0_int)
+            return false;
+        TIMG0_INT_CLR.t0_int = 1;
+    } else {
+        if (!TIMG0_INT_ST.t1_int)
+            return false;
+        TIMG0_INT_CLR.t1_int = 1;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Watchdog
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * How long a cpu can go without handling interrupts before
+ * we consider it as hanged, in milliseconds
+ */
+#define WDT_TIMEOUT_MS 1000
+
 static void wdt_unlock() {
-    TIMG0_WDTWPROTECT = 0x050D83AA1;
+    TIMG_CPU(WDTWPROTECT) = 0x050D83AA1;
 }
 
 static void wdt_lock() {
-    TIMG0_WDTWPROTECT = 0xDEADBEEF;
+    TIMG_CPU(WDTWPROTECT) = 0xDEADBEEF;
 }
 
 __attribute__((noinline))
 err_t init_wdt() {
     err_t err = NO_ERROR;
 
-    // allocate an interrupt for the watchdog
-    CHECK_AND_RETHROW(dport_map_interrupt(TG_WDT_LEVEL_INT, false));
+    // allocate an interrupt for the watchdog of the current cpu
+    CHECK_AND_RETHROW(dport_map_interrupt(get_cpu_index() == 0 ? TG_WDT_LEVEL_INT : TG1_WDT_LEVEL_INT, false));
 
     wdt_unlock();
 
-    // for pro cpu
+    // for the current cpu
     TIMG_WDTCONFIG_REG wdtconfig = {
         // do it as long as it is needed
         .level_int_en = 1,
@@ -120,28 +257,27 @@ err_t init_wdt() {
         // we reset the System if we have a problem
         .stg1 = 3,
     };
-    TIMG0_WDTCONFIG = wdtconfig;
+    TIMG_CPU(WDTCONFIG) = wdtconfig;
 
     // set the prescaler to 40000 * 12.5ns == 0.5ms, which means we have
     // two ticks per ms, so we just need to multiply the ms by 2
-    TIMG0_WDTCONFIG1 = 40000 << 16;
+    TIMG_CPU(WDTCONFIG1) = 40000 << 16;
 
-    // 10 ms for the first clock
-    TIMG0_WDTCONFIG2 = 10;
-
-    // 10ms for the second clock
-    TIMG0_WDTCONFIG3 = 10;
+    // the first stage only tells us that we are alive, if we
+    // did not handle it by the second stage we are hanged
+    TIMG_CPU(WDTCONFIG2) = WDT_TIMEOUT_MS * 2;
+    TIMG_CPU(WDTCONFIG3) = WDT_TIMEOUT_MS * 2;
 
     // enable it
-    TIMG0_WDTCONFIG.en = 1;
+    TIMG_CPU(WDTCONFIG).en = 1;
 
     wdt_lock();
 
     // enable watchdog timeout
-    TIMG0_INT_ENA.wdt_int = 1;
+    TIMG_CPU(INT_ENA).wdt_int = 1;
 
     // clear it
-    TIMG0_INT_CLR.wdt_int = 1;
+    TIMG_CPU(INT_CLR).wdt_int = 1;
 
 cleanup:
     return err;
@@ -149,32 +285,36 @@ cleanup:
 
 void wdt_enable() {
     wdt_unlock();
-    TIMG0_WDTCONFIG.en = 1;
+    TIMG_CPU(WDTCONFIG).en = 1;
     wdt_lock();
 }
 
 void wdt_disable() {
     wdt_unlock();
-    TIMG0_WDTCONFIG.en = 0;
+    TIMG_CPU(WDTCONFIG).en = 0;
     wdt_lock();
+
+    // make sure a timeout that already happened will
+    // not wake us up later on
+    TIMG_CPU(INT_CLR).wdt_int = 1;
 }
 
 void wdt_feed() {
     wdt_unlock();
-    TIMG0_WDTFEED = 1;
+    TIMG_CPU(WDTFEED) = 1;
     wdt_lock();
 }
 
 bool wdt_handle() {
     // check if we care
-    if (!TIMG0_INT_ST.wdt_int)
+    if (!TIMG_CPU(INT_ST).wdt_int)
         return false;
 
     // feed the watchdog
     wdt_feed();
 
     // clear the interrupts
-    TIMG0_INT_CLR.wdt_int = 1;
+    TIMG_CPU(INT_CLR).wdt_int = 1;
 
     return true;
 }
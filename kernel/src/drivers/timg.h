@@ -3,9 +3,45 @@
 #include "util/except.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
- * Initialize the watchdog and starting it
+ * Initialize the system timer, a free running 1MHz counter that
+ * is used as the monotonic clock of the kernel
+ */
+void init_systimer();
+
+/**
+ * Get the time since the system timer was started, in microseconds
+ */
+uint64_t systimer_now();
+
+/**
+ * Initialize the alarm timer of the current cpu, used for preemption
+ */
+err_t init_alarm();
+
+/**
+ * Raise an interrupt on the current cpu after the given amount
+ * of microseconds, replacing the previous alarm
+ *
+ * @param us    [IN] The timeout in microseconds
+ */
+void alarm_set(uint32_t us);
+
+/**
+ * Cancel the alarm of the current cpu
+ */
+void alarm_cancel();
+
+/**
+ * Handle an alarm interrupt
+ */
+bool alarm_handle();
+
+/**
+ * Initialize the watchdog of the current cpu and start it, if the cpu
+ * will not handle interrupts for too long the system is going to reset
  */
 err_t init_wdt();
 
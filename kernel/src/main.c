@@ -33,6 +33,21 @@ void* g_kernel_stacks[2] = {
     g_app_cpu_stack + sizeof(g_app_cpu_stack),
 };
 
+/**
+ * Set by the APP cpu once it is ready to schedule
+ */
+static volatile bool m_app_cpu_online = false;
+
+/**
+ * The cycle count of the PRO cpu, published while it waits for the APP cpu
+ */
+static volatile uint32_t m_pro_ccount = 0;
+
+/**
+ * The entry of the APP cpu
+ */
+extern symbol_t _app_start;
+
 static err_t load_from_initrd() {
     err_t err = NO_ERROR;
     initrd_header_t* header = NULL;
@@ -76,6 +91,9 @@ void kmain() {
     init_uart();
     TRACE("Hello from kernel!");
 
+    // start the clock as early as possible
+    init_systimer();
+
     // make sure we are running from the pro cpu
     ASSERT(get_cpu_index() == 0);
 
@@ -89,16 +107,12 @@ void kmain() {
     // initialize the kernel allocator
     CHECK_AND_RETHROW(init_mem());
 
-    // enable interrupts
-    ps = __read_ps();
-    ps.intlevel = 0;   // interrupts enabled
-    __write_ps(ps);
-
-    // clear all pending interrupts
+    // clear all pending interrupts, we keep them masked until
+    // we drop into the scheduler since we are running on the
+    // same stack as the interrupt handlers, the interrupts are
+    // enabled as they get mapped
     __WSR(INTCLEAR, BIT0);
-
-    // enable all interrupt levels
-    __WSR(INTENABLE, BIT0);
+    __WSR(INTENABLE, 0);
 
     // sync all these configurations
     __rsync();
@@ -106,7 +120,16 @@ void kmain() {
     // setup all the first tasks
     CHECK_AND_RETHROW(load_from_initrd());
 
+    // bring up the APP cpu and wait for it to be ready, while
+    // waiting give it our cycle count so it can sync to it
+    dport_start_app_cpu(_app_start);
+    while (!m_app_cpu_online) {
+        m_pro_ccount = __ccount();
+    }
+
     // init scheduler
+    CHECK_AND_RETHROW(dport_init_ipi());
+    CHECK_AND_RETHROW(init_alarm());
     CHECK_AND_RETHROW(init_wdt());
     scheduler_drop_current();
 
@@ -115,3 +138,44 @@ cleanup:
     ASSERT(!IS_ERROR(err));
     while(1);
 }
+
+void app_kmain() {
+    err_t err = NO_ERROR;
+
+    // same as the PRO cpu, interrupts are masked
+    // until we drop into the scheduler
+    ps_t ps = __read_ps();
+    ps.excm = 0;        // normal exception mode
+    ps.intlevel = 0xF;   // interrupts disabled
+    ps.um = 1;          // usermode
+    ps.woe = 1;         // window overflow enabled
+    __write_ps(ps);
+
+    TRACE("Hello from APP CPU!");
+
+    // sync the cycle count with the PRO cpu, so cycle
+    // stamps can be compared between the cpus
+    while (m_pro_ccount == 0);
+    __WSR(CCOUNT, m_pro_ccount);
+
+    // no interrupts until we map them
+    __WSR(INTCLEAR, BIT0);
+    __WSR(INTENABLE, 0);
+    __rsync();
+
+    // the pid controller state is per-cpu
+    init_pid();
+
+    // init scheduler
+    CHECK_AND_RETHROW(dport_init_ipi());
+    CHECK_AND_RETHROW(init_alarm());
+    CHECK_AND_RETHROW(init_wdt());
+
+    // we are ready, let the PRO cpu continue
+    m_app_cpu_online = true;
+    scheduler_drop_current();
+
+cleanup:
+    ASSERT(!IS_ERROR(err));
+    while(1);
+}
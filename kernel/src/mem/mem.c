@@ -2,6 +2,7 @@
 
 #include <umm_malloc.h>
 
+#include <util/spinlock.h>
 #include <util/string.h>
 #include <util/trace.h>
 
@@ -13,6 +14,8 @@ extern void* _heap_size;
 void* UMM_MALLOC_CFG_HEAP_ADDR = NULL;
 uint32_t UMM_MALLOC_CFG_HEAP_SIZE = 0;
 
+irq_spinlock_t g_umm_lock = INIT_NAMED_IRQ_SPINLOCK("malloc");
+
 err_t init_mem() {
     err_t err = NO_ERROR;
 
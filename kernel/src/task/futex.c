@@ -0,0 +1,173 @@
+#include "futex.h"
+#include "scheduler.h"
+#include "syscall.h"
+#include "arch/cpu.h"
+#include "drivers/timg.h"
+
+#include <util/spinlock.h>
+
+#include <stddef.h>
+
+/**
+ * The waiters of all the futexes that hash to it, linked by the sched link
+ */
+typedef struct futex_bucket {
+    irq_spinlock_t lock;
+    task_t* head;
+    task_t** tail;
+} futex_bucket_t;
+
+static futex_bucket_t m_futex_buckets[FUTEX_BUCKETS] = {
+    [0 ... FUTEX_BUCKETS - 1] = { .lock = INIT_NAMED_IRQ_SPINLOCK("futex") }
+};
+
+static futex_bucket_t* get_bucket(uint32_t* addr) {
+    return &m_futex_buckets[((uintptr_t)addr >> 2) % FUTEX_BUCKETS];
+}
+
+static void bucket_push(futex_bucket_t* bucket, task_t* task) {
+    if (bucket->head == NULL) {
+        bucket->tail = &bucket->head;
+    }
+    task->sched_link = NULL;
+    *bucket->tail = task;
+    bucket->tail = &task->sched_link;
+}
+
+/**
+ * Take the task out of the bucket, the caller must make sure it is in it
+ */
+static void bucket_remove(futex_bucket_t* bucket, task_t* task) {
+    task_t** link = &bucket->head;
+    while (*link != task) {
+        link = &(*link)->sched_link;
+    }
+    *link = task->sched_link;
+    if (bucket->tail == &task->sched_link) {
+        bucket->tail = link;
+    }
+    task->sched_link = NULL;
+}
+
+/**
+ * Stop the wait of a task that is in the bucket, it is readied once the
+ * bucket is unlocked, the result is written straight to its context
+ */
+static void end_wait(futex_bucket_t* bucket, task_t* task, int result) {
+    bucket_remove(bucket, task);
+    task->futex_waiting = false;
+    task->ucontext->regs.ar[SYSCALL_RET] = result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Futex api
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The wait timed out, the timer might have expired just as someone woke
+ * the task, that wake could not cancel the timer so it left the task for
+ * us to ready, this way the task can't start another wait that reuses the
+ * timer while we are still running for the old one
+ */
+static void futex_timeout_callback(void* arg) {
+    task_t* task = arg;
+    futex_bucket_t* bucket = get_bucket(task->futex_addr);
+
+    irq_spinlock_lock(&bucket->lock);
+    if (task->futex_waiting) {
+        end_wait(bucket, task, FUTEX_TIMED_OUT);
+    }
+    irq_spinlock_unlock(&bucket->lock);
+
+    scheduler_ready_task(task);
+}
+
+/**
+ * Called once the waiter is parked, only then it is safe for
+ * a wake to take it out of the bucket and ready it
+ */
+static void unlock_bucket_callback(void* arg) {
+    futex_bucket_t* bucket = arg;
+    irq_spinlock_unlock(&bucket->lock);
+}
+
+err_t futex_on_wait(task_regs_t* regs, uint32_t* addr, uint32_t expected, uint32_t timeout) {
+    err_t err = NO_ERROR;
+    task_t* current_task = get_current_task();
+    futex_bucket_t* bucket = get_bucket(addr);
+
+    CHECK_ERROR(((uintptr_t)addr % sizeof(uint32_t)) == 0, ERROR_INVALID_PTR);
+
+    irq_spinlock_lock(&bucket->lock);
+
+    // the value changed before we got to wait, a wake might
+    // have already happened so let the caller check again,
+    // anyone changing it after this point will find us
+    if (*(volatile uint32_t*)addr != expected) {
+        irq_spinlock_unlock(&bucket->lock);
+        regs->ar[SYSCALL_RET] = FUTEX_VALUE_CHANGED;
+        goto cleanup;
+    }
+
+    current_task->futex_addr = addr;
+    current_task->futex_waiting = true;
+    current_task->futex_timed = timeout != 0;
+    bucket_push(bucket, current_task);
+
+    // the timer is on the wheel of our cpu, so it can't fire
+    // before we are done parking
+    if (timeout != 0) {
+        timer_init(&current_task->sleep_timer, futex_timeout_callback, current_task);
+        timer_add(&current_task->sleep_timer, systimer_now() + timeout);
+    }
+
+    // park, the bucket is unlocked once we are parked, the
+    // result is set by whoever ends the wait
+    get_cpu_context()->park_callback = unlock_bucket_callback;
+    get_cpu_context()->park_arg = bucket;
+    scheduler_on_park(regs);
+
+cleanup:
+    return err;
+}
+
+err_t futex_wake(uint32_t* addr, uint32_t count, uint32_t* woken) {
+    err_t err = NO_ERROR;
+    futex_bucket_t* bucket = get_bucket(addr);
+    task_t* ready = NULL;
+    task_t** ready_tail = &ready;
+    uint32_t amount = 0;
+
+    CHECK_ERROR(((uintptr_t)addr % sizeof(uint32_t)) == 0, ERROR_INVALID_PTR);
+
+    irq_spinlock_lock(&bucket->lock);
+
+    task_t* task = bucket->head;
+    while (task != NULL && amount < count) {
+        task_t* next = task->sched_link;
+        if (task->futex_addr == addr) {
+            end_wait(bucket, task, FUTEX_WOKEN);
+            amount++;
+
+            // if the timer already expired its callback is on its
+            // way, it will see that the wait ended and ready the task
+            // itself, otherwise the sched link is free now, chain them
+            // in the order they waited so they are all readied at once
+            if (!task->futex_timed || timer_cancel(&task->sleep_timer)) {
+                *ready_tail = task;
+                ready_tail = &task->sched_link;
+            }
+        }
+        task = next;
+    }
+
+    irq_spinlock_unlock(&bucket->lock);
+
+    if (ready != NULL) {
+        scheduler_ready_tasks(ready);
+    }
+    *woken = amount;
+
+cleanup:
+    return err;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "task.h"
+
+#include <util/except.h>
+
+#include <stdint.h>
+
+/**
+ * The amount of buckets the waiters are hashed into
+ */
+#define FUTEX_BUCKETS 16
+
+/**
+ * Wait on a futex, parking the current task if the futex still has the
+ * expected value, on return the current task might be another one
+ *
+ * The futex is keyed by its kernel address, which is the physical page, so
+ * tasks that share the page will find each other, the result of the wait is
+ * returned to the task once it wakes up
+ *
+ * @param regs      [IN] The context of the current task
+ * @param addr      [IN] The kernel address of the futex
+ * @param expected  [IN] The value to wait on
+ * @param timeout   [IN] How long to wait in microseconds, 0 for forever
+ */
+err_t futex_on_wait(task_regs_t* regs, uint32_t* addr, uint32_t expected, uint32_t timeout);
+
+/**
+ * Wake tasks that wait on a futex, in the order they started waiting
+ *
+ * @param addr      [IN] The kernel address of the futex
+ * @param count     [IN] The max amount of tasks to wake
+ * @param woken     [OUT] The amount of tasks that were woken
+ */
+err_t futex_wake(uint32_t* addr, uint32_t count, uint32_t* woken);
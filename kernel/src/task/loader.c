@@ -6,6 +6,7 @@
 #include "mem/umem.h"
 #include "scheduler.h"
 #include "drivers/pid.h"
+#include "arch/cpu.h"
 
 err_t loader_load_app(const char* name, void* app, size_t app_size) {
     err_t err = NO_ERROR;
@@ -18,10 +19,15 @@ err_t loader_load_app(const char* name, void* app, size_t app_size) {
     CHECK(app_size >= sizeof(app_header_t));
     CHECK(app_size >= header->code_size + header->data_size);
     CHECK(USER_CODE_BASE <= header->entry && header->entry < USER_CODE_BASE + header->code_size);
+    CHECK(header->priority < SCHED_PRIORITY_COUNT);
+    CHECK((header->affinity & CPU_AFFINITY_ALL) != 0);
 
     // create the task
     task_t* task = create_task((void*)header->entry, name);
     CHECK_ERROR(task != NULL, ERROR_OUT_OF_RESOURCES);
+    task->priority = header->priority;
+    task->base_priority = header->priority;
+    task->affinity = header->affinity & CPU_AFFINITY_ALL;
 
     // prepare the sizes for allocation
     size_t code_pages = ALIGN_UP(header->code_size, USER_PAGE_SIZE) / USER_PAGE_SIZE;
@@ -0,0 +1,288 @@
+#include "mutex.h"
+#include "scheduler.h"
+#include "arch/cpu.h"
+
+#include <stddef.h>
+
+// all the mutexes, the handle is the index, the locks are only
+// initialized once so they can be registered for the stats
+static kmutex_t m_mutexes[KMUTEX_MAX] = {
+    [0 ... KMUTEX_MAX - 1] = { .lock = INIT_NAMED_IRQ_SPINLOCK("kmutex") }
+};
+
+// protects allocating mutexes
+static irq_spinlock_t m_mutexes_lock = INIT_NAMED_IRQ_SPINLOCK("mutexes");
+
+static err_t get_mutex(int handle, kmutex_t** mutex) {
+    err_t err = NO_ERROR;
+
+    CHECK_ERROR(0 <= handle && handle < KMUTEX_MAX, ERROR_NOT_FOUND);
+    CHECK_ERROR(m_mutexes[handle].used, ERROR_NOT_FOUND);
+    *mutex = &m_mutexes[handle];
+
+cleanup:
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Priority inheritance
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Give the mutex to the task, the held list is only changed by the task
+ * itself or while it is parked waiting for the mutex
+ */
+static void take_ownership(kmutex_t* mutex, task_t* task) {
+    mutex->owner = task;
+    mutex->held_link = task->held_mutexes;
+    task->held_mutexes = mutex;
+}
+
+static void release_ownership(kmutex_t* mutex, task_t* task) {
+    kmutex_t** link = &task->held_mutexes;
+    while (*link != mutex) {
+        link = &(*link)->held_link;
+    }
+    *link = mutex->held_link;
+    mutex->held_link = NULL;
+    mutex->owner = NULL;
+}
+
+/**
+ * Boost the owner of the mutex to the priority of the waiter, must
+ * be called with the mutex locked
+ */
+static void boost_owner(kmutex_t* mutex, uint8_t priority) {
+    task_t* owner = mutex->owner;
+
+    irq_spinlock_lock(&owner->boost_lock);
+    owner->boost_seq++;
+    if (priority < owner->boost_priority) {
+        owner->boost_priority = priority;
+        owner->stats.priority_boosts++;
+        scheduler_update_priority(owner);
+    }
+    irq_spinlock_unlock(&owner->boost_lock);
+}
+
+/**
+ * Recalculate the boost of a task from the waiters of the mutexes it
+ * still holds, the boost is only ever lowered by the task itself
+ */
+static void recalculate_boost(task_t* task) {
+    while (true) {
+        irq_spinlock_lock(&task->boost_lock);
+        uint32_t seq = task->boost_seq;
+        irq_spinlock_unlock(&task->boost_lock);
+
+        // the mutex locks are taken before the boost lock, so
+        // the waiters are gathered without holding it
+        uint8_t boost = SCHED_PRIORITY_COUNT;
+        for (kmutex_t* mutex = task->held_mutexes; mutex != NULL; mutex = mutex->held_link) {
+            irq_spinlock_lock(&mutex->lock);
+            if (mutex->waiters != NULL && mutex->waiters->priority < boost) {
+                boost = mutex->waiters->priority;
+            }
+            irq_spinlock_unlock(&mutex->lock);
+        }
+
+        // only apply it if no one boosted us in the meantime,
+        // otherwise that boost might be missing from ours
+        irq_spinlock_lock(&task->boost_lock);
+        bool raced = task->boost_seq != seq;
+        if (!raced) {
+            task->boost_priority = boost;
+            scheduler_update_priority(task);
+        }
+        irq_spinlock_unlock(&task->boost_lock);
+
+        if (!raced) {
+            break;
+        }
+    }
+}
+
+/**
+ * Hand the mutex to the most important waiter, the rest of the waiters
+ * are now boosting it instead, must be called with the mutex locked and
+ * released by its owner, returns the new owner that needs to be readied
+ */
+static task_t* hand_off(kmutex_t* mutex) {
+    task_t* next = mutex->waiters;
+    if (next != NULL) {
+        mutex->waiters = next->sched_link;
+        next->sched_link = NULL;
+        next->blocked_on = NULL;
+        take_ownership(mutex, next);
+
+        if (mutex->waiters != NULL) {
+            boost_owner(mutex, mutex->waiters->priority);
+        }
+    }
+    return next;
+}
+
+/**
+ * Add a waiter, sorted by priority and in fifo order for the same priority
+ */
+static void add_waiter(kmutex_t* mutex, task_t* task) {
+    task_t** link = &mutex->waiters;
+    while (*link != NULL && (*link)->priority <= task->priority) {
+        link = &(*link)->sched_link;
+    }
+    task->sched_link = *link;
+    *link = task;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Mutex api
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+err_t kmutex_create(int* handle) {
+    err_t err = NO_ERROR;
+
+    irq_spinlock_lock(&m_mutexes_lock);
+
+    int i;
+    for (i = 0; i < KMUTEX_MAX; i++) {
+        if (!m_mutexes[i].used) {
+            m_mutexes[i].owner = NULL;
+            m_mutexes[i].waiters = NULL;
+            m_mutexes[i].held_link = NULL;
+            m_mutexes[i].used = true;
+            break;
+        }
+    }
+
+    irq_spinlock_unlock(&m_mutexes_lock);
+
+    CHECK_ERROR(i != KMUTEX_MAX, ERROR_OUT_OF_RESOURCES);
+    *handle = i;
+
+cleanup:
+    return err;
+}
+
+err_t kmutex_destroy(int handle) {
+    err_t err = NO_ERROR;
+    kmutex_t* mutex = NULL;
+    bool locked = false;
+
+    CHECK_AND_RETHROW(get_mutex(handle, &mutex));
+
+    irq_spinlock_lock(&m_mutexes_lock);
+    irq_spinlock_lock(&mutex->lock);
+    locked = true;
+
+    CHECK_ERROR(mutex->owner == NULL, ERROR_NOT_READY);
+    mutex->used = false;
+
+cleanup:
+    if (locked) {
+        irq_spinlock_unlock(&mutex->lock);
+        irq_spinlock_unlock(&m_mutexes_lock);
+    }
+    return err;
+}
+
+/**
+ * Called once the waiter is parked, only then it is safe for an
+ * unlock to hand it the mutex and ready it
+ */
+static void unlock_mutex_callback(void* arg) {
+    kmutex_t* mutex = arg;
+    irq_spinlock_unlock(&mutex->lock);
+}
+
+err_t kmutex_on_lock(task_regs_t* regs, int handle) {
+    err_t err = NO_ERROR;
+    kmutex_t* mutex = NULL;
+    task_t* current_task = get_current_task();
+    bool locked = false;
+
+    CHECK_AND_RETHROW(get_mutex(handle, &mutex));
+
+    irq_spinlock_lock(&mutex->lock);
+    locked = true;
+
+    // fast path, the mutex is free
+    if (mutex->owner == NULL) {
+        take_ownership(mutex, current_task);
+        goto cleanup;
+    }
+
+    // we would wait forever
+    CHECK(mutex->owner != current_task);
+
+    // wait for the mutex, the owner can't be less
+    // important than us while we wait
+    add_waiter(mutex, current_task);
+    current_task->blocked_on = mutex;
+    boost_owner(mutex, current_task->priority);
+
+    // park, the mutex is unlocked once we are parked and the unlock
+    // will give it to us, so there is nothing to do once we wake up
+    get_cpu_context()->park_callback = unlock_mutex_callback;
+    get_cpu_context()->park_arg = mutex;
+    locked = false;
+    scheduler_on_park(regs);
+
+cleanup:
+    if (locked) {
+        irq_spinlock_unlock(&mutex->lock);
+    }
+    return err;
+}
+
+err_t kmutex_on_unlock(task_regs_t* regs, int handle) {
+    err_t err = NO_ERROR;
+    kmutex_t* mutex = NULL;
+    task_t* current_task = get_current_task();
+    bool locked = false;
+
+    CHECK_AND_RETHROW(get_mutex(handle, &mutex));
+
+    irq_spinlock_lock(&mutex->lock);
+    locked = true;
+
+    CHECK(mutex->owner == current_task);
+    release_ownership(mutex, current_task);
+    task_t* next = hand_off(mutex);
+
+    irq_spinlock_unlock(&mutex->lock);
+    locked = false;
+
+    // we no longer get the boost of the waiters of this mutex
+    uint8_t old_priority = current_task->priority;
+    recalculate_boost(current_task);
+
+    if (next != NULL) {
+        scheduler_ready_task(next);
+    }
+
+    // someone else might be more important than us now
+    if (current_task->priority > old_priority || (next != NULL && next->priority < current_task->priority)) {
+        scheduler_on_schedule(regs);
+    }
+
+cleanup:
+    if (locked) {
+        irq_spinlock_unlock(&mutex->lock);
+    }
+    return err;
+}
+
+void kmutex_release_all(task_t* task) {
+    while (task->held_mutexes != NULL) {
+        kmutex_t* mutex = task->held_mutexes;
+
+        irq_spinlock_lock(&mutex->lock);
+        release_ownership(mutex, task);
+        task_t* next = hand_off(mutex);
+        irq_spinlock_unlock(&mutex->lock);
+
+        if (next != NULL) {
+            scheduler_ready_task(next);
+        }
+    }
+}
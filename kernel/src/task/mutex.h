@@ -0,0 +1,83 @@
+#pragma once
+
+#include "task.h"
+
+#include <util/spinlock.h>
+#include <util/except.h>
+
+#include <stdint.h>
+
+/**
+ * The max amount of mutexes in the system
+ */
+#define KMUTEX_MAX 32
+
+/**
+ * A sleeping mutex with priority inheritance, a task that waits on the mutex
+ * boosts the owner to its own priority until the owner releases the mutex, so
+ * a less important owner can't be held back by work that is more important
+ * than it but less important than the waiter
+ *
+ * The mutex is handed directly to the most important waiter on unlock
+ *
+ * The inheritance is only a single level deep, if the owner itself waits on
+ * another mutex the owner of that one is not boosted, so chains of mutexes
+ * can still see inversion
+ */
+typedef struct kmutex {
+    // protects the mutex
+    irq_spinlock_t lock;
+
+    // the task that holds the mutex, NULL if free
+    task_t* owner;
+
+    // the waiting tasks sorted by priority, linked by the sched link
+    task_t* waiters;
+
+    // link in the list of mutexes held by the owner
+    struct kmutex* held_link;
+
+    // the mutex is allocated
+    bool used;
+} kmutex_t;
+
+/**
+ * Allocate a new mutex
+ *
+ * @param handle    [OUT] The handle of the mutex
+ */
+err_t kmutex_create(int* handle);
+
+/**
+ * Free a mutex, it must not be held by anyone
+ *
+ * @param handle    [IN] The handle of the mutex
+ */
+err_t kmutex_destroy(int handle);
+
+/**
+ * Lock the mutex for the current task, parking it if the mutex is taken, on
+ * return the current task might be another one
+ *
+ * @param regs      [IN] The context of the current task
+ * @param handle    [IN] The handle of the mutex
+ */
+err_t kmutex_on_lock(task_regs_t* regs, int handle);
+
+/**
+ * Unlock a mutex held by the current task, waking the next owner, on
+ * return the current task might be another one
+ *
+ * @param regs      [IN] The context of the current task
+ * @param handle    [IN] The handle of the mutex
+ */
+err_t kmutex_on_unlock(task_regs_t* regs, int handle);
+
+/**
+ * Release all the mutexes that a dying task still holds, each one is handed
+ * to its most important waiter, or left free if there is none, the task
+ * itself does not lose its boost since it is not going to run again
+ *
+ * @param task      [IN] The task that is dropped
+ */
+void kmutex_release_all(task_t* task);
@@ -1,14 +1,23 @@
 #include "scheduler.h"
 #include "arch/cpu.h"
+#include "arch/fpu.h"
+#include "drivers/dport.h"
 #include "drivers/timg.h"
 #include "syscall.h"
+#include "mutex.h"
 
-// little helper to deal with the global run queue
-typedef struct task_queue {
-    task_t* head;
-    task_t* tail;
-} task_queue_t;
+#include <stdatomic.h>
 
+/**
+ * Pinned tasks are those that can't run on all the cpus, they always
+ * wait in the local run queue of one of their cpus, and they are never
+ * moved to the global run queue or stolen
+ */
+static bool task_pinned(task_t* task) {
+    return task->affinity != CPU_AFFINITY_ALL;
+}
+
+// little helpers to deal with the run queues
 static void task_queue_push_back(task_queue_t* q, task_t* thread) {
     thread->sched_link = NULL;
     if (q->tail != NULL) {
@@ -16,82 +25,1194 @@ static void task_queue_push_back(task_queue_t* q, task_t* thread) {
     } else {
         q->head = thread;
     }
-    q->tail = thread;
-}
+    q->tail = thread;
+}
+
+static task_t* task_queue_pop(task_queue_t* q) {
+    task_t* task = q->head;
+    if (task != NULL) {
+        q->head = task->sched_link;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    return task;
+}
+
+/**
+ * Put a task at the back of the level of its priority
+ */
+static void run_queue_push(run_queue_t* rq, task_t* task) {
+    task->queue_level = task->priority;
+    task_queue_push_back(&rq->levels[task->queue_level], task);
+    task->run_queue = rq;
+    rq->ready |= 1 << task->queue_level;
+    rq->size++;
+    if (task_pinned(task)) {
+        rq->pinned++;
+    }
+}
+
+static task_t* run_queue_pop_level(run_queue_t* rq, int level) {
+    task_queue_t* q = &rq->levels[level];
+    task_t* task = task_queue_pop(q);
+    if (q->head == NULL) {
+        rq->ready &= ~(1 << level);
+    }
+    rq->size--;
+    if (task_pinned(task)) {
+        rq->pinned--;
+    }
+    task->run_queue = NULL;
+    return task;
+}
+
+/**
+ * Remove a task from the middle of the run queue, this needs to walk
+ * the level of the task but the levels are short anyways, the level is
+ * the one the task was queued at since its priority might have changed
+ */
+static void run_queue_remove(run_queue_t* rq, task_t* task) {
+    task_queue_t* q = &rq->levels[task->queue_level];
+
+    task_t* prev = NULL;
+    task_t** link = &q->head;
+    while (*link != task) {
+        prev = *link;
+        link = &(*link)->sched_link;
+    }
+
+    *link = task->sched_link;
+    if (q->tail == task) {
+        q->tail = prev;
+    }
+    if (q->head == NULL) {
+        rq->ready &= ~(1 << task->queue_level);
+    }
+    rq->size--;
+    if (task_pinned(task)) {
+        rq->pinned--;
+    }
+
+    task->sched_link = NULL;
+    task->run_queue = NULL;
+}
+
+/**
+ * Pop the most important task, this is O(1) since we only need
+ * to find the first set bit in the ready bitmap
+ */
+static task_t* run_queue_pop(run_queue_t* rq) {
+    if (rq->ready == 0) {
+        return NULL;
+    }
+    return run_queue_pop_level(rq, __builtin_ffs(rq->ready) - 1);
+}
+
+/**
+ * Pop the least important task, used when moving tasks out of a full run queue
+ */
+static task_t* run_queue_pop_lowest(run_queue_t* rq) {
+    if (rq->ready == 0) {
+        return NULL;
+    }
+    return run_queue_pop_level(rq, 31 - __builtin_clz(rq->ready));
+}
+
+/**
+ * Pop a task that may leave this run queue, either the most important or the
+ * least important one, this walks over the pinned tasks in the way
+ */
+static task_t* run_queue_pop_movable(run_queue_t* rq, bool lowest) {
+    if (rq->size == rq->pinned) {
+        return NULL;
+    }
+
+    // fast path, nothing is pinned
+    if (rq->pinned == 0) {
+        return lowest ? run_queue_pop_lowest(rq) : run_queue_pop(rq);
+    }
+
+    uint32_t ready = rq->ready;
+    while (ready != 0) {
+        int level = lowest ? 31 - __builtin_clz(ready) : __builtin_ffs(ready) - 1;
+        ready &= ~(1 << level);
+
+        for (task_t* task = rq->levels[level].head; task != NULL; task = task->sched_link) {
+            if (!task_pinned(task)) {
+                run_queue_remove(rq, task);
+                return task;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Get the priority of the most important task in the run queue, this
+ * is done without a lock so it is only a hint
+ */
+static int run_queue_best_priority(run_queue_t* rq) {
+    uint32_t ready = rq->ready;
+    return ready == 0 ? SCHED_PRIORITY_COUNT : __builtin_ffs(ready) - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Timeslice
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The length of the timeslice of normal tasks, in microseconds
+ */
+#define SCHED_TIMESLICE_US 10000
+
+/**
+ * Program the timer to interrupt us after the given amount of microseconds
+ */
+static void scheduler_set_deadline(uint32_t timeout) {
+    get_cpu_context()->tick_stopped = false;
+    alarm_set(timeout);
+}
+
+static void scheduler_cancel_deadline() {
+    get_cpu_context()->tick_stopped = true;
+    alarm_cancel();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Global run queue
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Every how many schedules we are going to check the global run queue
+ * before the local one, to make sure nothing starves on it
+ */
+#define GLOBAL_RUN_QUEUE_FAIRNESS 61
+
+// The global run queue, only used for overflow
+// of the local run queues and for fairness
+static run_queue_t m_global_run_queue;
+
+// spinlock to protect the scheduler internal stuff
+static irq_spinlock_t m_scheduler_lock = INIT_NAMED_IRQ_SPINLOCK("scheduler");
+
+int32_t g_current_pid[CPU_COUNT] = {};
+
+static void global_run_queue_put(task_t* task) {
+    run_queue_push(&m_global_run_queue, task);
+}
+
+static task_t* global_run_queue_get() {
+    return run_queue_pop(&m_global_run_queue);
+}
+
+static void lock_scheduler() {
+    irq_spinlock_lock(&m_scheduler_lock);
+}
+
+static void unlock_scheduler() {
+    irq_spinlock_unlock(&m_scheduler_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Local run queue
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void lock_run_queue(run_queue_t* rq) {
+    irq_spinlock_lock(&rq->lock);
+}
+
+static void unlock_run_queue(run_queue_t* rq) {
+    irq_spinlock_unlock(&rq->lock);
+}
+
+/**
+ * Put a task that can't run on this cpu on the run queue of the first cpu
+ * that it can run on, and kick that cpu so it will consider it
+ */
+static void remote_run_queue_put(task_t* task) {
+    uint32_t cpu = __builtin_ffs(task->affinity) - 1;
+    run_queue_t* rq = &g_per_cpu_context[cpu].run_queue;
+
+    // pinned tasks can't go anywhere else, so they
+    // always go in even if the run queue is full
+    lock_run_queue(rq);
+    run_queue_push(rq, task);
+    unlock_run_queue(rq);
+
+    dport_send_ipi(cpu);
+}
+
+/**
+ * Put a task on the local run queue, if the local run queue is full
+ * then the less important half of it is moved to the global run queue
+ */
+static void local_run_queue_put(task_t* task) {
+    run_queue_t* rq = &get_cpu_context()->run_queue;
+
+    // the task can't run here
+    if (!(task->affinity & (1 << get_cpu_index()))) {
+        remote_run_queue_put(task);
+        return;
+    }
+
+    lock_run_queue(rq);
+
+    // the current task is no longer alone, give it a timeslice
+    if (get_cpu_context()->tick_stopped && get_cpu_context()->current_task != NULL) {
+        scheduler_set_deadline(SCHED_TIMESLICE_US);
+    }
+
+    // fast path, we have space in the local run queue, pinned
+    // tasks can't go anywhere else so they always go in
+    if (rq->size < RUN_QUEUE_LEN || task_pinned(task)) {
+        run_queue_push(rq, task);
+        unlock_run_queue(rq);
+        return;
+    }
+
+    // slow path, take half of the local run queue, so
+    // we won't need to do it again on the next put, the
+    // pinned tasks stay where they are
+    task_queue_t batch = {};
+    for (int i = 0; i < RUN_QUEUE_LEN / 2; i++) {
+        task_t* moved = run_queue_pop_movable(rq, true);
+        if (moved == NULL) {
+            break;
+        }
+        task_queue_push_back(&batch, moved);
+    }
+
+    unlock_run_queue(rq);
+
+    // and move it to the global run queue, with the new task
+    lock_scheduler();
+    while (batch.head != NULL) {
+        global_run_queue_put(task_queue_pop(&batch));
+    }
+    global_run_queue_put(task);
+    unlock_scheduler();
+}
+
+/**
+ * How many tasks at the front of the best level we look at for one whose
+ * space is already bound on this cpu, and how many times in a row we may
+ * pass over the head of the level for it, so the head can't starve
+ */
+#define PID_AFFINITY_SCAN       4
+#define PID_AFFINITY_MAX_SKIPS  2
+
+/**
+ * Check if the space of the task has a pid binding on this cpu, switching
+ * to it then does not need to reload the mmu, this is only a hint
+ */
+static bool task_bound_here(task_t* task) {
+    pid_binding_t* bindings = get_cpu_context()->pid_bindings;
+
+    // the other cpu might be moving the space right now
+    pid_bindings_lock();
+    pid_binding_t* binding = task->mmu.binding;
+    pid_bindings_unlock();
+
+    return binding >= bindings && binding < bindings + PID_BINDING_COUNT;
+}
+
+/**
+ * Pop the most important task, but prefer one that is already bound on
+ * this cpu from the tasks with the same priority
+ */
+static task_t* run_queue_pop_bound(run_queue_t* rq) {
+    per_cpu_context_t* pctx = get_cpu_context();
+
+    if (rq->ready == 0) {
+        return NULL;
+    }
+
+    int level = __builtin_ffs(rq->ready) - 1;
+    task_t* head = rq->levels[level].head;
+
+    // the head is good enough, or it waited long enough
+    if (task_bound_here(head) || pctx->pid_affinity_skips >= PID_AFFINITY_MAX_SKIPS) {
+        pctx->pid_affinity_skips = 0;
+        return run_queue_pop_level(rq, level);
+    }
+
+    task_t* task = head->sched_link;
+    for (int i = 1; task != NULL && i < PID_AFFINITY_SCAN; i++, task = task->sched_link) {
+        if (task_bound_here(task)) {
+            pctx->pid_affinity_skips++;
+            run_queue_remove(rq, task);
+            return task;
+        }
+    }
+
+    pctx->pid_affinity_skips = 0;
+    return run_queue_pop_level(rq, level);
+}
+
+/**
+ * Bind the space of the task that is most likely to run next on this cpu
+ * into a spare pid, so the switch to it will only need a rebind
+ */
+static void local_run_queue_prebind() {
+    per_cpu_context_t* pctx = get_cpu_context();
+    run_queue_t* rq = &pctx->run_queue;
+
+    // nothing in here, no need to take the lock
+    if (rq->size == 0) {
+        return;
+    }
+
+    // keep the lock while binding, so the task can't be
+    // taken and freed by someone else
+    lock_run_queue(rq);
+    if (rq->ready != 0) {
+        task_t* next = rq->levels[__builtin_ffs(rq->ready) - 1].head;
+        if (!task_bound_here(next) && mmu_prebind(&next->mmu)) {
+            pctx->stats.pid_prebinds++;
+        }
+    }
+    unlock_run_queue(rq);
+}
+
+static task_t* local_run_queue_get() {
+    run_queue_t* rq = &get_cpu_context()->run_queue;
+
+    // nothing in here, no need to take the lock
+    if (rq->size == 0) {
+        return NULL;
+    }
+
+    lock_run_queue(rq);
+    task_t* task = run_queue_pop_bound(rq);
+    unlock_run_queue(rq);
+
+    return task;
+}
+
+/**
+ * Take a batch of tasks from the global run queue, putting all
+ * but the first one into the local run queue, the first one is
+ * returned so it can run right away
+ */
+static task_t* global_run_queue_get_batch() {
+    run_queue_t* rq = &get_cpu_context()->run_queue;
+
+    // nothing in here, no need to take the lock
+    if (m_global_run_queue.size == 0) {
+        return NULL;
+    }
+
+    lock_scheduler();
+
+    // take a fair share of the global run queue, but not more
+    // than what we can fit in the local run queue
+    int32_t n = m_global_run_queue.size / CPU_COUNT + 1;
+    if (n > m_global_run_queue.size) {
+        n = m_global_run_queue.size;
+    }
+    if (n > RUN_QUEUE_LEN / 2) {
+        n = RUN_QUEUE_LEN / 2;
+    }
+
+    task_t* task = global_run_queue_get();
+    task_queue_t batch = {};
+    for (int i = 1; i < n; i++) {
+        task_queue_push_back(&batch, global_run_queue_get());
+    }
+
+    unlock_scheduler();
+
+    // put the rest in our local queue
+    if (batch.head != NULL) {
+        lock_run_queue(rq);
+        while (batch.head != NULL) {
+            run_queue_push(rq, task_queue_pop(&batch));
+        }
+        unlock_run_queue(rq);
+    }
+
+    return task;
+}
+
+/**
+ * Steal half of the run queue of another cpu, the first stolen
+ * task is returned and the rest are put on our local run queue
+ */
+static task_t* local_run_queue_steal() {
+    uint32_t cpu_index = get_cpu_index();
+    run_queue_t* rq = &get_cpu_context()->run_queue;
+
+    for (int i = 1; i < CPU_COUNT; i++) {
+        run_queue_t* victim = &g_per_cpu_context[(cpu_index + i) % CPU_COUNT].run_queue;
+
+        // nothing to steal in here, pinned tasks stay with their cpu
+        if (victim->size - victim->pinned == 0) {
+            continue;
+        }
+
+        // take the more important half of the victim, we
+        // are always stealing at least one task
+        task_queue_t batch = {};
+        lock_run_queue(victim);
+        int32_t movable = victim->size - victim->pinned;
+        int32_t n = movable - movable / 2;
+        for (int j = 0; j < n; j++) {
+            task_t* stolen = run_queue_pop_movable(victim, false);
+            if (stolen == NULL) {
+                break;
+            }
+            task_queue_push_back(&batch, stolen);
+        }
+        unlock_run_queue(victim);
+
+        // someone took it before us
+        if (batch.head == NULL) {
+            continue;
+        }
+
+        // run the first one right away, and put the
+        // rest in our local run queue
+        task_t* task = task_queue_pop(&batch);
+        if (batch.head != NULL) {
+            lock_run_queue(rq);
+            while (batch.head != NULL) {
+                run_queue_push(rq, task_queue_pop(&batch));
+            }
+            unlock_run_queue(rq);
+        }
+
+        return task;
+    }
+
+    return NULL;
+}
+
+/**
+ * Lock either a local run queue or the global one, the global
+ * run queue is protected by the scheduler lock
+ */
+static void lock_any_run_queue(run_queue_t* rq) {
+    if (rq == &m_global_run_queue) {
+        lock_scheduler();
+    } else {
+        lock_run_queue(rq);
+    }
+}
+
+static void unlock_any_run_queue(run_queue_t* rq) {
+    if (rq == &m_global_run_queue) {
+        unlock_scheduler();
+    } else {
+        unlock_run_queue(rq);
+    }
+}
+
+/**
+ * Take a task out of whatever run queue it is waiting in, fails if the task
+ * is not in any run queue, for example because it is running right now
+ */
+static bool run_queue_take(task_t* task) {
+    run_queue_t* rq = task->run_queue;
+    if (rq == NULL) {
+        return false;
+    }
+
+    lock_any_run_queue(rq);
+
+    // make sure no one took it before we got the lock
+    bool taken = task->run_queue == rq;
+    if (taken) {
+        run_queue_remove(rq, task);
+    }
+
+    unlock_any_run_queue(rq);
+
+    return taken;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Idle cpus
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// bitmask of the cpus that are parked in the idle loop
+static atomic_uint m_idle_cpus = 0;
+
+static void cpu_put_idle() {
+    atomic_fetch_or(&m_idle_cpus, 1 << get_cpu_index());
+}
+
+static void cpu_wake_idle() {
+    atomic_fetch_and(&m_idle_cpus, ~(1 << get_cpu_index()));
+}
+
+/**
+ * Find another idle cpu out of the given ones, -1 if there is none
+ */
+static int find_idle_cpu(uint32_t affinity) {
+    uint32_t idle = atomic_load(&m_idle_cpus) & affinity & ~(1 << get_cpu_index());
+    return idle == 0 ? -1 : __builtin_ffs(idle) - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Earliest deadline first
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The bandwidth of edf tasks is kept in fixed point, we only allow
+ * giving 95% of each cpu to edf tasks so the normal ones will not
+ * completely starve
+ */
+#define EDF_BW_SHIFT 16
+#define EDF_BW_CAPACITY ((95 << EDF_BW_SHIFT) / 100)
+
+static uint64_t edf_key(task_t* task, bool throttled) {
+    return throttled ? task->edf.next_release : task->edf.abs_deadline;
+}
+
+/**
+ * Insert a task into a sorted edf queue, the ready queue is sorted by the
+ * absolute deadline and the throttled one by the next release, tasks with
+ * the same key keep their order so they are round-robined
+ */
+static void edf_queue_insert(task_queue_t* q, task_t* task, bool throttled) {
+    uint64_t key = edf_key(task, throttled);
+
+    task_t** link = &q->head;
+    while (*link != NULL && edf_key(*link, throttled) <= key) {
+        link = &(*link)->sched_link;
+    }
+
+    task->sched_link = *link;
+    *link = task;
+    if (task->sched_link == NULL) {
+        q->tail = task;
+    }
+}
+
+/**
+ * Start a new job of the task, if the previous job did not
+ * complete by now it means it missed its deadline
+ */
+static void edf_new_job(task_t* task, uint64_t now) {
+    task_edf_t* edf = &task->edf;
+
+    if (!edf->done && !edf->missed) {
+        task->stats.edf_misses++;
+    }
+
+    // if we are late then the new job starts now, otherwise
+    // it starts on its release time
+    uint64_t start = edf->next_release > now ? edf->next_release : now;
+    edf->abs_deadline = start + edf->deadline;
+    edf->next_release = start + edf->period;
+    edf->remaining = edf->budget;
+    edf->done = false;
+    edf->missed = false;
+}
+
+/**
+ * Put an edf task in the queues of the cpu it was admitted to, if the current
+ * job is done or is out of budget it is throttled until its next release
+ */
+static void edf_put(task_t* task) {
+    per_cpu_context_t* pctx = &g_per_cpu_context[task->edf.cpu];
+
+    lock_run_queue(&pctx->run_queue);
+    if (task->edf.done || task->edf.remaining <= 0) {
+        edf_queue_insert(&pctx->edf_throttled, task, true);
+    } else {
+        edf_queue_insert(&pctx->edf_queue, task, false);
+    }
+    unlock_run_queue(&pctx->run_queue);
+
+    // let the other cpu know it has a new task to consider, if
+    // it is our cpu make sure the current task will be preempted
+    if (task->edf.cpu != get_cpu_index()) {
+        dport_send_ipi(task->edf.cpu);
+    } else if (pctx->tick_stopped && pctx->current_task != NULL) {
+        scheduler_set_deadline(SCHED_TIMESLICE_US);
+    }
+}
+
+/**
+ * Release all the jobs that are due, and take the one with the earliest deadline
+ */
+static task_t* edf_get() {
+    per_cpu_context_t* pctx = get_cpu_context();
+
+    // nothing in here, no need to take the lock
+    if (pctx->edf_queue.head == NULL && pctx->edf_throttled.head == NULL) {
+        return NULL;
+    }
+
+    uint64_t now = systimer_now();
+
+    lock_run_queue(&pctx->run_queue);
+
+    while (pctx->edf_throttled.head != NULL && pctx->edf_throttled.head->edf.next_release <= now) {
+        task_t* task = task_queue_pop(&pctx->edf_throttled);
+        edf_new_job(task, now);
+        task->ready_stamp = __ccount();
+        edf_queue_insert(&pctx->edf_queue, task, false);
+    }
+
+    task_t* task = task_queue_pop(&pctx->edf_queue);
+
+    unlock_run_queue(&pctx->run_queue);
+
+    // we are already too late for this one
+    if (task != NULL && now > task->edf.abs_deadline && !task->edf.missed) {
+        task->edf.missed = true;
+        task->stats.edf_misses++;
+    }
+
+    return task;
+}
+
+/**
+ * Take the bandwidth of the task back from its cpu
+ */
+static void edf_release_bw(task_t* task) {
+    if (task->sched_class != SCHED_CLASS_EDF) {
+        return;
+    }
+
+    lock_scheduler();
+    g_per_cpu_context[task->edf.cpu].edf_bw -= task->edf.bw;
+    unlock_scheduler();
+
+    task->sched_class = SCHED_CLASS_NORMAL;
+}
+
+err_t scheduler_set_edf(uint32_t period, uint32_t budget, uint32_t deadline) {
+    err_t err = NO_ERROR;
+    task_t* task = get_current_task();
+
+    // going back to the normal class
+    if (period == 0) {
+        edf_release_bw(task);
+        goto cleanup;
+    }
+
+    CHECK(budget != 0);
+    CHECK(budget <= deadline);
+    CHECK(deadline <= period);
+
+    // we use the density and not the utilization, so
+    // constrained deadlines are also safe to admit
+    uint32_t bw = ((uint64_t)budget << EDF_BW_SHIFT) / deadline;
+
+    // find the first cpu that can fit us, not counting
+    // the bandwidth we are replacing
+    lock_scheduler();
+
+    if (task->sched_class == SCHED_CLASS_EDF) {
+        g_per_cpu_context[task->edf.cpu].edf_bw -= task->edf.bw;
+    }
+
+    int cpu = -1;
+    for (int i = 0; i < CPU_COUNT; i++) {
+        if (!(task->affinity & (1 << i))) {
+            continue;
+        }
+
+        if (g_per_cpu_context[i].edf_bw + bw <= EDF_BW_CAPACITY) {
+            cpu = i;
+            break;
+        }
+    }
+
+    if (cpu != -1) {
+        g_per_cpu_context[cpu].edf_bw += bw;
+    } else if (task->sched_class == SCHED_CLASS_EDF) {
+        // keep the old parameters
+        g_per_cpu_context[task->edf.cpu].edf_bw += task->edf.bw;
+    }
+
+    unlock_scheduler();
+
+    CHECK_ERROR(cpu != -1, ERROR_OUT_OF_RESOURCES);
+
+    // the first job starts right away, we are running so
+    // we are not in any queue and can just set it
+    uint64_t now = systimer_now();
+    task->sched_class = SCHED_CLASS_EDF;
+    task->edf.period = period;
+    task->edf.budget = budget;
+    task->edf.deadline = deadline;
+    task->edf.bw = bw;
+    task->edf.cpu = cpu;
+    task->edf.abs_deadline = now + deadline;
+    task->edf.next_release = now + period;
+    task->edf.remaining = budget;
+    task->edf.done = false;
+    task->edf.missed = false;
+
+cleanup:
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CPU quotas
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool task_has_quota(task_t* task) {
+    return task->sched_class == SCHED_CLASS_NORMAL && task->quota.period != 0;
+}
+
+/**
+ * Start a new period if the current one is over, if we are more than
+ * a period late the new period starts now
+ */
+static void quota_refill(task_t* task, uint64_t now) {
+    task_quota_t* quota = &task->quota;
+    if (now < quota->period_end) {
+        return;
+    }
+
+    quota->remaining = quota->budget;
+    if (now - quota->period_end < quota->period) {
+        quota->period_end += quota->period;
+    } else {
+        quota->period_end = now + quota->period;
+    }
+}
+
+static void quota_refill_callback(void* arg) {
+    task_t* task = arg;
+    quota_refill(task, systimer_now());
+    scheduler_ready_task(task);
+}
+
+/**
+ * Throttle the task if it used all of its quota, it is kept waiting until
+ * the next period and is then readied again
+ *
+ * @returns true if the task was throttled
+ */
+static bool quota_throttle(task_t* task) {
+    if (!task_has_quota(task)) {
+        return false;
+    }
+
+    quota_refill(task, systimer_now());
+    if (task->quota.remaining > 0) {
+        return false;
+    }
+
+    task->stats.quota_throttles++;
+    cas_task_state(task, TASK_STATUS_RUNNABLE, TASK_STATUS_WAITING);
+
+    timer_init(&task->quota.refill_timer, quota_refill_callback, task);
+    timer_add(&task->quota.refill_timer, task->quota.period_end);
+
+    return true;
+}
+
+err_t scheduler_set_quota(uint32_t period, uint32_t budget) {
+    err_t err = NO_ERROR;
+    task_t* task = get_current_task();
+
+    if (period != 0) {
+        CHECK(budget != 0);
+        CHECK(budget <= period);
+    }
+
+    // the new period starts now, we are running so we are
+    // not throttled and the budget is used from now on
+    task->quota.period = period;
+    task->quota.budget = budget;
+    task->quota.remaining = budget;
+    task->quota.period_end = systimer_now() + period;
+    get_cpu_context()->budget_start = systimer_now();
+
+cleanup:
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Wake a thread
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//----------------------------------------------------------------------------------------------------------------------
+// Wakeup lists
+//
+// Readying a task never takes a lock, the task is pushed with S32C1I onto the wakeup list of the cpu that
+// should run it, and that cpu moves it to its queues the next time it schedules, so waking from an interrupt
+// or from the other cpu never spins on a lock that the other cpu holds.
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Push a chain of tasks linked by their wake link, first is the newest
+ * and last is the oldest, just like the list itself
+ */
+static void wake_list_push(per_cpu_context_t* pctx, task_t* first, task_t* last) {
+    uint32_t head;
+    do {
+        head = (uint32_t)pctx->wake_list;
+        last->wake_link = (task_t*)head;
+        __memw();
+    } while (__s32c1i((volatile uint32_t*)&pctx->wake_list, head, (uint32_t)first) != head);
+}
+
+/**
+ * Take everything on the wakeup list of a cpu, the list is swapped out
+ * at once so any cpu can do it, returns the tasks in the order they were
+ * readied in, linked by their wake link
+ */
+static task_t* wake_list_take(per_cpu_context_t* pctx) {
+    if (pctx->wake_list == NULL) {
+        return NULL;
+    }
+
+    // take the whole list at once
+    uint32_t head;
+    do {
+        head = (uint32_t)pctx->wake_list;
+    } while (__s32c1i((volatile uint32_t*)&pctx->wake_list, head, 0) != head);
+
+    // the list is in reverse order of wakeup, flip it
+    // so the tasks keep the order they were readied in
+    task_t* list = NULL;
+    task_t* task = (task_t*)head;
+    while (task != NULL) {
+        task_t* next = task->wake_link;
+        task->wake_link = list;
+        list = task;
+        task = next;
+    }
+
+    return list;
+}
+
+/**
+ * Move the taken tasks to the queues of the current cpu, the ones
+ * that can't run here are passed on to a cpu that they can run on
+ */
+static void wake_list_put(task_t* list) {
+    while (list != NULL) {
+        task_t* task = list;
+        list = task->wake_link;
+        task->wake_link = NULL;
+
+        if (task->sched_class == SCHED_CLASS_EDF) {
+            edf_put(task);
+        } else if (!quota_throttle(task)) {
+            local_run_queue_put(task);
+        }
+    }
+}
+
+/**
+ * Move everything on the wakeup list of the current cpu to its queues
+ */
+static void wake_list_drain() {
+    wake_list_put(wake_list_take(get_cpu_context()));
+}
+
+/**
+ * Take the tasks that were readied for the other cpus and are still on their
+ * wakeup lists, a cpu that did not take them yet is busy running something,
+ * and stealing can't see them there, returns true if there were any
+ */
+static bool wake_list_drain_others() {
+    uint32_t cpu_index = get_cpu_index();
+    bool found = false;
+
+    for (int i = 1; i < CPU_COUNT; i++) {
+        task_t* list = wake_list_take(&g_per_cpu_context[(cpu_index + i) % CPU_COUNT]);
+        if (list != NULL) {
+            wake_list_put(list);
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Check if the task should run before the current task of a cpu, edf
+ * tasks come before everything else and are ordered by their deadline
+ */
+static bool task_outranks(task_t* task, task_t* current) {
+    if (task->sched_class == SCHED_CLASS_EDF) {
+        return current->sched_class != SCHED_CLASS_EDF || task->edf.abs_deadline < current->edf.abs_deadline;
+    }
+
+    return current->sched_class != SCHED_CLASS_EDF && task->priority < current->priority;
+}
+
+/**
+ * Choose the cpu that will take the readied task, edf and pinned tasks go
+ * to their cpu, the rest go to an idle cpu if there is one so they can
+ * start right away, or stay on the current cpu
+ */
+static uint32_t wake_target(task_t* task) {
+    uint32_t cpu_index = get_cpu_index();
+
+    if (task->sched_class == SCHED_CLASS_EDF) {
+        return task->edf.cpu;
+    }
+
+    int idle = find_idle_cpu(task->affinity);
+    if (idle != -1) {
+        return idle;
+    }
+
+    if (!(task->affinity & (1 << cpu_index))) {
+        return __builtin_ffs(task->affinity) - 1;
+    }
+
+    return cpu_index;
+}
+
+/**
+ * Let the cpu know that we pushed to its wakeup list
+ *
+ * @param cpu   [IN] The cpu
+ * @param best  [IN] The most important of the tasks that were pushed
+ */
+static void wake_cpu(uint32_t cpu, task_t* best) {
+    per_cpu_context_t* pctx = get_cpu_context();
+
+    if (cpu != get_cpu_index()) {
+        // let the other cpu know it has a new task to consider, it
+        // will preempt its current task if the new one outranks it
+        dport_send_ipi(cpu);
+    } else if (pctx->current_task != NULL && task_outranks(best, pctx->current_task)) {
+        // the new task should not wait for the timeslice of the
+        // current one to end, reschedule once we leave the kernel
+        scheduler_set_deadline(0);
+    } else if (pctx->tick_stopped && pctx->current_task != NULL) {
+        // the current task is no longer alone, make sure
+        // we will get to the new one
+        scheduler_set_deadline(SCHED_TIMESLICE_US);
+    }
+}
+
+/**
+ * Mark a waiting task as runnable
+ */
+static void mark_ready(task_t* task) {
+    ASSERT((get_task_status(task) & ~TASK_SUSPEND) == TASK_STATUS_WAITING);
+
+    cas_task_state(task, TASK_STATUS_WAITING, TASK_STATUS_RUNNABLE);
+    task->ready_stamp = __ccount();
+    task->woken = true;
+}
+
+void scheduler_ready_task(task_t* task) {
+    task->sched_link = NULL;
+
+    scheduler_preempt_disable();
+
+    mark_ready(task);
+
+    uint32_t cpu = wake_target(task);
+    wake_list_push(&g_per_cpu_context[cpu], task, task);
+    wake_cpu(cpu, task);
+
+    scheduler_preempt_enable();
+}
+
+void scheduler_ready_tasks(task_t* list) {
+    // the chain for each cpu, newest first, and the
+    // most important task in each of them
+    task_t* first[CPU_COUNT] = {};
+    task_t* last[CPU_COUNT] = {};
+    task_t* best[CPU_COUNT] = {};
+
+    scheduler_preempt_disable();
+
+    // sort the tasks by the cpu that is going to take them
+    while (list != NULL) {
+        task_t* task = list;
+        list = task->sched_link;
+        task->sched_link = NULL;
+
+        mark_ready(task);
+
+        uint32_t cpu = wake_target(task);
+        task->wake_link = first[cpu];
+        first[cpu] = task;
+        if (last[cpu] == NULL) {
+            last[cpu] = task;
+        }
+        if (best[cpu] == NULL || task_outranks(task, best[cpu])) {
+            best[cpu] = task;
+        }
+    }
 
-static task_t* task_queue_pop(task_queue_t* q) {
-    task_t* task = q->head;
-    if (task != NULL) {
-        q->head = task->sched_link;
-        if (q->head == NULL) {
-            q->tail = NULL;
+    // and give each cpu its whole chain at once
+    for (int cpu = 0; cpu < CPU_COUNT; cpu++) {
+        if (first[cpu] != NULL) {
+            wake_list_push(&g_per_cpu_context[cpu], first[cpu], last[cpu]);
+            wake_cpu(cpu, best[cpu]);
         }
     }
-    return task;
-}
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Global run queue
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    scheduler_preempt_enable();
+}
 
-#define RUN_QUEUE_LEN 256
+err_t scheduler_set_priority(uint32_t priority) {
+    err_t err = NO_ERROR;
 
-// The global run queue
-static task_queue_t m_global_run_queue;
-static int32_t m_global_run_queue_size;
+    CHECK(priority < SCHED_PRIORITY_COUNT);
 
-// spinlock to protect the scheduler internal stuff
-//static irq_spinlock_t m_scheduler_lock = INIT_IRQ_SPINLOCK();
+    // we are running so we are not in any run queue, it
+    // will take effect once we get back into one
+    task_t* task = get_current_task();
+    irq_spinlock_lock(&task->boost_lock);
+    task->base_priority = priority;
+    task->priority = priority < task->boost_priority ? priority : task->boost_priority;
+    irq_spinlock_unlock(&task->boost_lock);
 
-static void global_run_queue_put(task_t* task) {
-    task_queue_push_back(&m_global_run_queue, task);
-    m_global_run_queue_size++;
+cleanup:
+    return err;
 }
 
-static task_t* global_run_queue_get() {
-    if (m_global_run_queue_size == 0) {
-        return NULL;
+void scheduler_update_priority(task_t* task) {
+    uint8_t priority = task->base_priority < task->boost_priority ? task->base_priority : task->boost_priority;
+    if (task->priority == priority) {
+        return;
     }
-    m_global_run_queue_size--;
-    task_t* task = task_queue_pop(&m_global_run_queue);
-    return task;
-}
 
-static void lock_scheduler() {
-//    irq_spinlock_lock(&m_scheduler_lock);
-}
+    // if it is waiting in a run queue move it to its new level
+    run_queue_t* rq = task->run_queue;
+    if (rq != NULL) {
+        lock_any_run_queue(rq);
+        if (task->run_queue == rq) {
+            run_queue_remove(rq, task);
+            task->priority = priority;
+            run_queue_push(rq, task);
+            unlock_any_run_queue(rq);
+            return;
+        }
+        unlock_any_run_queue(rq);
+    }
 
-static void unlock_scheduler() {
-//    irq_spinlock_unlock(&m_scheduler_lock);
+    // otherwise it is used the next time the task is queued, the
+    // queues always use the level the task was queued at
+    task->priority = priority;
 }
 
-static void wake_cpu() {
-    // TODO: this
+err_t scheduler_set_affinity(uint32_t affinity) {
+    err_t err = NO_ERROR;
+    task_t* task = get_current_task();
+
+    affinity &= CPU_AFFINITY_ALL;
+    CHECK(affinity != 0);
+
+    // edf tasks stay on the cpu they were admitted to, they need
+    // to go back to the normal class to change their affinity
+    if (task->sched_class == SCHED_CLASS_EDF) {
+        CHECK(affinity & (1 << task->edf.cpu));
+    }
+
+    // we are running so we are not in any run queue, it
+    // will take effect once we get back into one
+    task->affinity = affinity;
+
+cleanup:
+    return err;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Wake a thread
+// Statistics
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void scheduler_ready_task(task_t* task) {
-    task->sched_link = NULL;
+err_t scheduler_get_stats(void* buffer, size_t size, size_t* written) {
+    err_t err = NO_ERROR;
 
-    scheduler_preempt_disable();
+    stats_header_t* header = buffer;
+    stats_cpu_record_t* cpus = (stats_cpu_record_t*)(header + 1);
+    stats_lock_record_t* locks = (stats_lock_record_t*)(cpus + CPU_COUNT);
 
-    ASSERT((get_task_status(task) & ~TASK_SUSPEND) == TASK_STATUS_WAITING);
+    // we must at least fit the header and the cpus
+    CHECK_ERROR(((uintptr_t)buffer % 8) == 0, ERROR_INVALID_PTR);
+    CHECK(size >= (void*)locks - buffer);
 
-    // Mark as runnable
-    cas_task_state(task, TASK_STATUS_WAITING, TASK_STATUS_RUNNABLE);
+    uint32_t now = __ccount();
 
-    // Put in the run queue
-    lock_scheduler();
-    global_run_queue_put(task);
-    unlock_scheduler();
+    // the counters of the other cpu might change while we copy
+    // them, but they are only going up so it is fine
+    for (int i = 0; i < CPU_COUNT; i++) {
+        cpus[i].stats = g_per_cpu_context[i].stats;
+    }
 
-    // in case someone can steal
-    wake_cpu();
+    // take as many locks as we can fit, the counters are read
+    // without taking the lock so they might be a bit off
+    int lock_count = 0;
+    size_t left = size - ((void*)locks - buffer);
+    for (irq_spinlock_t* lock = get_next_spinlock(NULL); lock != NULL && left >= sizeof(stats_lock_record_t); lock = get_next_spinlock(lock)) {
+        stats_lock_record_t* record = &locks[lock_count++];
+        left -= sizeof(stats_lock_record_t);
+
+#ifdef SPINLOCK_STATS
+        record->address = (uintptr_t)lock;
+        record->acquisitions = lock->acquisitions;
+        record->contended = lock->contended;
+        record->spin_cycles = lock->spin_cycles;
+
+        int i = 0;
+        if (lock->name != NULL) {
+            for (; i < sizeof(record->name) - 1 && lock->name[i] != '\0'; i++) {
+                record->name[i] = lock->name[i];
+            }
+        }
+        record->name[i] = '\0';
+#endif
+    }
 
-    scheduler_preempt_enable();
+    // take as many tasks as we can fit
+    int count = 0;
+    stats_task_record_t* tasks = (stats_task_record_t*)(locks + lock_count);
+    for (task_t* task = get_next_task(NULL); task != NULL && left >= sizeof(stats_task_record_t); task = get_next_task(task)) {
+        stats_task_record_t* record = &tasks[count++];
+        left -= sizeof(stats_task_record_t);
+
+        record->pid = task->pid;
+        record->status = get_task_status(task);
+        record->priority = task->priority;
+        record->sched_class = task->sched_class;
+        record->_reserved = 0;
+        record->stats = task->stats;
+        record->quota_period = task->quota.period;
+        record->quota_budget = task->quota.budget;
+        record->quota_used = task->quota.period == 0 ? 0 : task->quota.budget - (task->quota.remaining > 0 ? task->quota.remaining : 0);
+
+        int i;
+        for (i = 0; i < sizeof(record->name) - 1 && task->ucontext->name[i] != '\0'; i++) {
+            record->name[i] = task->ucontext->name[i];
+        }
+        record->name[i] = '\0';
+
+        // include the time of a task that is running right now,
+        // so the cpu usage will not jump around
+        for (int cpu = 0; cpu < CPU_COUNT; cpu++) {
+            if (g_per_cpu_context[cpu].current_task == task) {
+                record->stats.run_cycles += now - g_per_cpu_context[cpu].exec_stamp;
+            }
+        }
+    }
+
+    header->version = STATS_VERSION;
+    header->header_size = sizeof(stats_header_t);
+    header->cpu_record_size = sizeof(stats_cpu_record_t);
+    header->task_record_size = sizeof(stats_task_record_t);
+    header->cpu_count = CPU_COUNT;
+    header->task_count = count;
+    header->timestamp = now;
+    header->lock_record_size = sizeof(stats_lock_record_t);
+    header->lock_count = lock_count;
+    header->_reserved = 0;
+
+    *written = (void*)&tasks[count] - buffer;
+
+cleanup:
+    return err;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -99,15 +1220,14 @@ void scheduler_ready_task(task_t* task) {
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 void scheduler_preempt_disable(void) {
-    if (get_cpu_context()->preempt_disable_depth++ == 0) {
-        // TODO: enable no preemption
-    }
+    get_cpu_context()->preempt_disable_depth++;
 }
 
 void scheduler_preempt_enable(void) {
-    if (++get_cpu_context()->preempt_disable_depth == 0) {
-        // TODO: disable no preemption
-    }
+    per_cpu_context_t* pctx = get_cpu_context();
+
+    ASSERT(pctx->preempt_disable_depth > 0);
+    pctx->preempt_disable_depth--;
 }
 
 
@@ -119,55 +1239,192 @@ void scheduler_preempt_enable(void) {
 // Actually running a thread
 //----------------------------------------------------------------------------------------------------------------------
 
-static void scheduler_set_deadline() {
-    wdt_feed();
-    wdt_enable();
+/**
+ * Check if there is anything else that this cpu might need to run,
+ * the run queues of other cpus are going to be handled by them
+ */
+static bool has_local_work() {
+    per_cpu_context_t* pctx = get_cpu_context();
+    return pctx->run_queue.size != 0 || pctx->edf_queue.head != NULL || m_global_run_queue.size != 0;
 }
 
-static void scheduler_cancel_deadline() {
-    wdt_disable();
+/**
+ * Get the time of the next event that this cpu needs to wake up for,
+ * UINT64_MAX if there is none
+ */
+static uint64_t next_local_event() {
+    per_cpu_context_t* pctx = get_cpu_context();
+    uint64_t next = UINT64_MAX;
+
+    // the release of the next edf job
+    task_t* edf = pctx->edf_throttled.head;
+    if (edf != NULL) {
+        next = edf->edf.next_release;
+    }
+
+    // the next timer, sleepers and timeouts
+    uint64_t timer = timers_next_event();
+    if (timer < next) {
+        next = timer;
+    }
+
+    return next;
+}
+
+/**
+ * Program the timer for the next thing that needs the attention of the
+ * scheduler, if there is nothing then there is no need for a tick at all
+ */
+static void scheduler_program_timer(task_t* task) {
+    uint64_t now = systimer_now();
+    uint64_t deadline = next_local_event();
+
+    // only need a timeslice if there is someone to share the cpu with
+    if (task != NULL && has_local_work()) {
+        if (now + SCHED_TIMESLICE_US < deadline) {
+            deadline = now + SCHED_TIMESLICE_US;
+        }
+    }
+
+    // edf tasks must stop once their budget is spent
+    if (task != NULL && task->sched_class == SCHED_CLASS_EDF) {
+        uint64_t exhausted = now + (task->edf.remaining > 0 ? task->edf.remaining : 0);
+        if (exhausted < deadline) {
+            deadline = exhausted;
+        }
+    }
+
+    // and so do tasks with a quota, even when they are alone
+    if (task != NULL && task_has_quota(task)) {
+        quota_refill(task, now);
+        uint64_t exhausted = now + (task->quota.remaining > 0 ? task->quota.remaining : 0);
+        if (exhausted < deadline) {
+            deadline = exhausted;
+        }
+    }
+
+    if (deadline == UINT64_MAX) {
+        scheduler_cancel_deadline();
+    } else {
+        uint64_t timeout = deadline > now ? deadline - now : 0;
+        scheduler_set_deadline(timeout > UINT32_MAX ? UINT32_MAX : timeout);
+    }
 }
 
 /**
  * Execute the thread on the current cpu
  *
- * @param ctx               [IN] The context of the scheduler interrupt
  * @param thread            [IN] The thread to run
+ * @param donated           [IN] The thread continues the timeslice of the previous one
  */
-static void execute(task_regs_t* ctx, task_t* task) {
+static void execute(task_t* task, bool donated) {
+    per_cpu_context_t* pctx = get_cpu_context();
+
     // set the current thread
-    get_cpu_context()->current_task = task;
+    pctx->current_task = task;
+    g_current_pid[get_cpu_index()] = task->pid;
+
+    // account the time it waited for us
+    uint32_t now = __ccount();
+    uint32_t waited = now - task->ready_stamp;
+    task->stats.wait_cycles += waited;
+    if (task->woken) {
+        pctx->stats.wakeup_latency[waited == 0 ? 0 : 31 - __builtin_clz(waited)]++;
+        task->woken = false;
+    }
+    pctx->exec_stamp = now;
+
+    // count the switches that can reuse the pid binding of the
+    // task, the rest will have to reload the mmu, the binding is
+    // looked at under the lock since the other cpu might take it
+    pid_bindings_lock();
+    pid_binding_t* binding = task->mmu.binding;
+    pid_binding_t* bindings = pctx->pid_bindings;
+    if (binding >= bindings && binding < bindings + PID_BINDING_COUNT) {
+        pctx->stats.pid_hits++;
+        if (binding->prebound) {
+            pctx->stats.pid_prebind_hits++;
+        }
+    } else {
+        pctx->stats.pid_misses++;
+    }
+    pid_bindings_unlock();
 
     // get ready to run it
     cas_task_state(task, TASK_STATUS_RUNNABLE, TASK_STATUS_RUNNING);
 
-    // set a new timeslice of 10 milliseconds
-    scheduler_set_deadline();
+    // set a new timeslice, or none at all if we are alone, a
+    // donated slice must still respect the quota of the task
+    if (!donated || task_has_quota(task)) {
+        scheduler_program_timer(task);
+    }
+
+    // start accounting the budget
+    if (task->sched_class == SCHED_CLASS_EDF || task_has_quota(task)) {
+        get_cpu_context()->budget_start = systimer_now();
+    }
 
-    // set the gprs context
-    restore_task_context(task, ctx);
+    // return to the context of the task, the fpu
+    // is only given to it once it uses it
+    restore_task_context(task);
+    fpu_disable();
 
     // prepare for the switch
     pid_prepare();
+
+    // the switch is done, get the next one ready while we are at it, a
+    // donated slice is a latency sensitive handoff so leave it be
+    if (!donated) {
+        local_run_queue_prebind();
+    }
 }
 
-static void save_current_task(task_regs_t* ctx, bool park) {
+/**
+ * Save the current task and take it off the cpu
+ *
+ * @param ctx               [IN] The context of the scheduler interrupt
+ * @param park              [IN] The task is going to wait instead of going back to the run queue
+ * @param voluntary         [IN] The task gave up the cpu, as opposed to being preempted
+ */
+static void save_current_task(task_regs_t* ctx, bool park, bool voluntary) {
     per_cpu_context_t* pctx = get_cpu_context();
 
     ASSERT(pctx->current_task != NULL);
     task_t* current_task = pctx->current_task;
     pctx->current_task = NULL;
 
-    // save the state and set the thread to runnable
-    save_task_context(current_task, ctx);
+    // account the time it ran
+    uint32_t now = __ccount();
+    current_task->stats.run_cycles += now - pctx->exec_stamp;
+    current_task->ready_stamp = now;
+    if (voluntary) {
+        current_task->stats.voluntary_switches++;
+    } else {
+        current_task->stats.involuntary_switches++;
+    }
+
+    // the state was already saved in place by the exception entry
+    ASSERT(ctx == &current_task->ucontext->regs);
+    fpu_save(current_task);
+
+    // charge the time it ran to the budget of the current job, or the quota
+    if (current_task->sched_class == SCHED_CLASS_EDF) {
+        current_task->edf.remaining -= (int32_t)(systimer_now() - pctx->budget_start);
+    } else if (task_has_quota(current_task)) {
+        current_task->quota.remaining -= (int32_t)(systimer_now() - pctx->budget_start);
+    }
 
     // put the thread back
     if (!park) {
         // set the thread to be runnable
         cas_task_state(current_task, TASK_STATUS_RUNNING, TASK_STATUS_RUNNABLE);
 
-        // put in the local run queue
-        global_run_queue_put(current_task);
+        // put in the local run queue, unless it used all of its quota
+        if (current_task->sched_class == SCHED_CLASS_EDF) {
+            edf_put(current_task);
+        } else if (!quota_throttle(current_task)) {
+            local_run_queue_put(current_task);
+        }
     } else {
         cas_task_state(current_task, TASK_STATUS_RUNNING, TASK_STATUS_WAITING);
     }
@@ -177,73 +1434,402 @@ static void save_current_task(task_regs_t* ctx, bool park) {
 // Scheduler itself
 //----------------------------------------------------------------------------------------------------------------------
 
-static void cpu_put_idle() {
-}
+/**
+ * Check if there is anything in any of the run queues
+ */
+static bool has_runnable_work() {
+    // someone readied a task, for us or for a cpu that
+    // is too busy to take it
+    for (int i = 0; i < CPU_COUNT; i++) {
+        if (g_per_cpu_context[i].wake_list != NULL) {
+            return true;
+        }
+    }
 
-static void cpu_wake_idle() {
+    if (m_global_run_queue.size != 0) {
+        return true;
+    }
+
+    // we can only take the tasks of other cpus that are not pinned to them
+    uint32_t cpu_index = get_cpu_index();
+    for (int i = 0; i < CPU_COUNT; i++) {
+        run_queue_t* rq = &g_per_cpu_context[i].run_queue;
+        if (rq->size - (i == cpu_index ? 0 : rq->pinned) != 0) {
+            return true;
+        }
+    }
+
+    // the edf tasks of our cpu, the throttled ones
+    // are only runnable once they are released
+    if (get_cpu_context()->edf_queue.head != NULL) {
+        return true;
+    }
+
+    return false;
 }
 
-static task_t* find_runnable() {
+/**
+ * Look in all the queues for something to run, in order of importance
+ */
+static task_t* find_task() {
+    per_cpu_context_t* pctx = get_cpu_context();
     task_t* task = NULL;
 
-    while (true) {
-        // get from the global run queue
+    // edf tasks always come first
+    task = edf_get();
+    if (task != NULL) {
+        return task;
+    }
+
+    // check the global run queue once in a while, so the
+    // tasks on it will not starve if the local run queue
+    // is always full
+    if ((pctx->sched_tick++ % GLOBAL_RUN_QUEUE_FAIRNESS) == 0 && m_global_run_queue.size > 0) {
         lock_scheduler();
         task = global_run_queue_get();
         unlock_scheduler();
         if (task != NULL) {
             return task;
         }
+    }
+
+    // the global run queue has something more important
+    // than what we have locally, take from it first
+    if (run_queue_best_priority(&m_global_run_queue) < run_queue_best_priority(&pctx->run_queue)) {
+        task = global_run_queue_get_batch();
+        if (task != NULL) {
+            return task;
+        }
+    }
+
+    // get from the local run queue
+    task = local_run_queue_get();
+    if (task != NULL) {
+        return task;
+    }
+
+    // get from the global run queue
+    task = global_run_queue_get_batch();
+    if (task != NULL) {
+        return task;
+    }
+
+    // tasks readied for a busy cpu wait on its wakeup list
+    // where stealing can't see them, take those first
+    if (wake_list_drain_others()) {
+        task = local_run_queue_get();
+        if (task != NULL) {
+            return task;
+        }
+    }
+
+    // try to steal from another cpu
+    return local_run_queue_steal();
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Idle
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The bounds of how long we spin before sleeping, in cycles, if work
+ * usually comes later than the max it is not worth spinning at all
+ */
+#define IDLE_SPIN_MIN_CYCLES 1000
+#define IDLE_SPIN_MAX_CYCLES 20000
+
+/**
+ * The weight of a new gap in the average, as a shift
+ */
+#define IDLE_GAP_SHIFT 3
+
+/**
+ * Account for the time it took for work to show up after going idle
+ */
+static void idle_update_gap(uint32_t gap) {
+    per_cpu_context_t* pctx = get_cpu_context();
+    int32_t diff = (int32_t)(gap - pctx->idle_gap_avg);
+    pctx->idle_gap_avg += diff >> IDLE_GAP_SHIFT;
+}
+
+/**
+ * How long to spin based on the recent gaps, we spin for twice the average
+ * so most of the wakeups will fall inside the spin
+ */
+static uint32_t idle_spin_limit() {
+    uint32_t avg = get_cpu_context()->idle_gap_avg;
+    if (avg > IDLE_SPIN_MAX_CYCLES) {
+        return 0;
+    }
+
+    uint32_t limit = avg * 2;
+    if (limit < IDLE_SPIN_MIN_CYCLES) {
+        limit = IDLE_SPIN_MIN_CYCLES;
+    } else if (limit > IDLE_SPIN_MAX_CYCLES) {
+        limit = IDLE_SPIN_MAX_CYCLES;
+    }
+    return limit;
+}
+
+/**
+ * Spin for a bit waiting for work, we are not marked as idle so anyone
+ * readying a task will not bother with an IPI, and we will steal it
+ *
+ * @returns true if there is work to do
+ */
+static bool idle_spin(uint32_t limit) {
+    uint32_t start = __ccount();
+    while (__ccount() - start < limit) {
+        if (has_runnable_work()) {
+            return true;
+        }
+
+        // an interrupt is waiting, no point in spinning, the
+        // WAITI will return right away and we will handle it
+        if (__RSR(INTERRUPT) & __RSR(INTENABLE)) {
+            break;
+        }
+
+        // make sure we read the queues again
+        __memw();
+    }
+    return false;
+}
+
+static task_t* find_runnable() {
+    per_cpu_context_t* pctx = get_cpu_context();
+    task_t* task = NULL;
+
+    // if we went idle while looking, and when
+    bool idle = false;
+    uint32_t idle_since = 0;
+
+    while (true) {
+        // fire all the expired timers, this might ready
+        // tasks so it must come before checking the queues
+        if (pctx->timer_wheel.count != 0) {
+            timers_run(systimer_now());
+        }
+
+        // take in everything that was readied for us
+        wake_list_drain();
+
+        task = find_task();
+        if (task != NULL) {
+            if (idle) {
+                idle_update_gap(__ccount() - idle_since);
+            }
+            return task;
+        }
 
         //
         // We have nothing to do
         //
 
-        lock_scheduler();
+        uint32_t idle_start = __ccount();
+        if (!idle) {
+            idle = true;
+            idle_since = idle_start;
+        }
+        pctx->stats.idle_entries++;
+
+        // there is no timeslice while we don't have a task, only
+        // wake up for the next event if there is any
+        scheduler_program_timer(NULL);
+
+        // work often comes right after we run out of it, spin
+        // for a bit before paying for a full sleep and wakeup
+        if (idle_spin(idle_spin_limit())) {
+            pctx->stats.idle_spin_hits++;
+            pctx->stats.idle_cycles += __ccount() - idle_start;
+            continue;
+        }
 
-        // we are now idle
+        // we are now idle, from this point anyone readying
+        // a task is going to send us an IPI
         cpu_put_idle();
 
-        unlock_scheduler();
-
-        // TODO: spinning
+        // check again in case someone readied a task before
+        // seeing us as idle, otherwise we would miss the IPI
+        if (has_runnable_work()) {
+            cpu_wake_idle();
+            pctx->stats.idle_cycles += __ccount() - idle_start;
+            continue;
+        }
 
         // we have nothing to do, so put the cpu into
         // a sleeping state until an interrupt or something
-        // else happens. we will lower the state
+        // else happens. we will lower the state, and the
+        // kernel exception vector is going to raise it
+        // back once we get an interrupt
         asm volatile ("WAITI 0");
 
-        lock_scheduler();
         cpu_wake_idle();
-        unlock_scheduler();
+        pctx->stats.idle_cycles += __ccount() - idle_start;
 
+        // acknowledge the wakeup, if it was an IPI, the alarm or the
+        // watchdog, anything else will be handled once we return to usermode
+        dport_handle_ipi();
+        if (alarm_handle()) {
+            pctx->stats.idle_alarm_wakeups++;
+        }
+        wdt_handle();
     }
 }
 
-static void schedule(task_regs_t* ctx) {
+static void schedule() {
     // will block until a thread is ready, essentially an idle loop,
     // this must return something eventually.
     task_t* thread = find_runnable();
 
     // actually run the new thread
-    execute(ctx, thread);
+    execute(thread, false);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 // Scheduler callbacks
 //----------------------------------------------------------------------------------------------------------------------
 
-void scheduler_on_schedule(task_regs_t* regs) {
+/**
+ * Check if scheduling would just pick the current task again, which is
+ * the case when nothing that would come before it in find_task is there,
+ * tasks with a budget must be charged on the way out so they never qualify
+ */
+static bool keep_current_task(task_t* task) {
+    per_cpu_context_t* pctx = get_cpu_context();
+
+    // the task is no longer allowed on this cpu, it must move
+    if (!(task->affinity & (1 << get_cpu_index()))) {
+        return false;
+    }
+
+    if (task->sched_class == SCHED_CLASS_EDF || task_has_quota(task)) {
+        return false;
+    }
+
+    // same as find_runnable, fire the timers and take
+    // in what was readied for us before looking
+    if (pctx->timer_wheel.count != 0) {
+        timers_run(systimer_now());
+    }
+    wake_list_drain();
+
+    // any edf task comes first, including ones that
+    // are about to be released
+    if (pctx->edf_queue.head != NULL) {
+        return false;
+    }
+    if (pctx->edf_throttled.head != NULL && pctx->edf_throttled.head->edf.next_release <= systimer_now()) {
+        return false;
+    }
+
+    // the global run queue is checked before the local one
+    if (m_global_run_queue.size != 0) {
+        return false;
+    }
+
+    // we would go to the back of our priority level, so only
+    // less important tasks can be left in the local run queue
+    return run_queue_best_priority(&pctx->run_queue) > task->priority;
+}
+
+/**
+ * Put the current task back in the run queue and schedule a new one
+ */
+static void reschedule(task_regs_t* regs, bool voluntary) {
+    per_cpu_context_t* pctx = get_cpu_context();
+
+    // we would get the same task back, so skip the run queue
+    // and just give it a new timeslice, its context is still
+    // the one that is going to be restored
+    if (keep_current_task(pctx->current_task)) {
+        pctx->stats.same_task_returns++;
+        scheduler_program_timer(pctx->current_task);
+        return;
+    }
+
     // save the current thread, don't park it
-    save_current_task(regs, false);
+    save_current_task(regs, false, voluntary);
 
     // now schedule a new thread
-    schedule(regs);
+    schedule();
+}
+
+void scheduler_on_schedule(task_regs_t* regs) {
+    reschedule(regs, false);
+}
+
+void scheduler_on_yield(task_regs_t* regs) {
+    task_t* current_task = get_current_task();
+
+    // for edf tasks yielding means the current job is done,
+    // so it will wait for the release of the next one
+    if (current_task->sched_class == SCHED_CLASS_EDF) {
+        if (systimer_now() > current_task->edf.abs_deadline && !current_task->edf.missed) {
+            current_task->edf.missed = true;
+            current_task->stats.edf_misses++;
+        }
+        current_task->edf.done = true;
+    }
+
+    reschedule(regs, true);
+}
+
+err_t scheduler_on_yield_to(task_regs_t* regs, pid_t pid) {
+    err_t err = NO_ERROR;
+    per_cpu_context_t* pctx = get_cpu_context();
+    task_t* current_task = pctx->current_task;
+    task_t* task = NULL;
+
+    // hold a reference so the target can't be freed under us
+    task = get_task_by_pid(pid);
+    CHECK_ERROR(task != NULL, ERROR_NOT_FOUND);
+    CHECK(task != current_task);
+
+    // it is already dying
+    CHECK_ERROR(get_task_status(task) != TASK_STATUS_DEAD, ERROR_NOT_FOUND);
+
+    // we can't run it on our cpu
+    CHECK_ERROR(task->affinity & (1 << get_cpu_index()), ERROR_NOT_READY);
+
+    // we can only switch to a task that is waiting in a run queue,
+    // once we took it no one else can run it
+    CHECK_ERROR(run_queue_take(task), ERROR_NOT_READY);
+
+    // the target gets the rest of our timeslice, edf tasks
+    // have their own budget so they can't donate it
+    bool donated = current_task->sched_class == SCHED_CLASS_NORMAL && !pctx->tick_stopped;
+
+    // save the current thread, it goes to the back of the
+    // run queue just like a normal yield
+    save_current_task(regs, false, true);
+
+    // and run the target right away on our cpu
+    execute(task, donated);
+
+cleanup:
+    SAFE_RELEASE_TASK(task);
+    return err;
+}
+
+static void sleep_timer_callback(void* arg) {
+    scheduler_ready_task(arg);
+}
+
+void scheduler_on_sleep(task_regs_t* regs, uint32_t us) {
+    task_t* current_task = get_current_task();
+
+    // the timer is on the wheel of our cpu, so it can't fire
+    // before we are done parking
+    timer_init(&current_task->sleep_timer, sleep_timer_callback, current_task);
+    timer_add(&current_task->sleep_timer, systimer_now() + us);
+
+    scheduler_on_park(regs);
 }
 
 void scheduler_on_park(task_regs_t* regs) {
     // save the current thread, park it
-    save_current_task(regs, true);
+    save_current_task(regs, true, true);
 
     // check if we need to call a callback before we schedule
     per_cpu_context_t* pctx = get_cpu_context();
@@ -257,7 +1843,7 @@ void scheduler_on_park(task_regs_t* regs) {
     scheduler_cancel_deadline();
 
     // schedule a new thread
-    schedule(regs);
+    schedule();
 }
 
 void scheduler_on_drop(task_regs_t* regs) {
@@ -270,6 +1856,19 @@ void scheduler_on_drop(task_regs_t* regs) {
         // change the status to dead
         cas_task_state(current_task, TASK_STATUS_RUNNING, TASK_STATUS_DEAD);
 
+        // give back the bandwidth it had
+        edf_release_bw(current_task);
+
+        // whoever waits on its mutexes would wait forever
+        kmutex_release_all(current_task);
+
+        // the fpu must not think it still holds the state of a task that
+        // is about to be freed, another cpu might still point to it too,
+        // but a new task starts with no fpu cpu so it will never match
+        if (pctx->fpu_owner == current_task) {
+            pctx->fpu_owner = NULL;
+        }
+
         // release the reference that the scheduler has
         release_task(current_task);
     }
@@ -277,7 +1876,7 @@ void scheduler_on_drop(task_regs_t* regs) {
     // cancel the deadline of the current thread, as it is dead
     scheduler_cancel_deadline();
 
-    schedule(regs);
+    schedule();
 }
 
 //----------------------------------------------------------------------------------------------------------------------
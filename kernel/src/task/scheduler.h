@@ -2,7 +2,55 @@
 
 #include "task.h"
 
-#define CPU_COUNT 2
+#include <util/spinlock.h>
+#include <syscall.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Run queues
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The max amount of tasks in a local run queue, we can't have more than 16 tasks
+ * anyways (each one takes a data page for its ucontext), so anything above that
+ * is going to be an overflow to the global run queue
+ */
+#define RUN_QUEUE_LEN 32
+
+/**
+ * Intrusive queue of tasks, linked by the sched_link
+ */
+typedef struct task_queue {
+    task_t* head;
+    task_t* tail;
+} task_queue_t;
+
+/**
+ * The amount of priority levels, each run queue has
+ * a queue for each of the levels
+ */
+#define SCHED_PRIORITY_COUNT (SCHED_PRIORITY_LOWEST + 1)
+STATIC_ASSERT(SCHED_PRIORITY_COUNT <= 32);
+
+/**
+ * A bounded run queue, each cpu has its own one, it is only
+ * touched by other cpus when they come to steal work
+ */
+typedef struct run_queue {
+    // the tasks in the queue, per priority
+    task_queue_t levels[SCHED_PRIORITY_COUNT];
+
+    // bitmap of the levels that have tasks in them, the
+    // lowest bit is the highest priority
+    uint32_t ready;
+
+    // the amount of tasks in the queue, and how many of them
+    // are pinned to it so no one else can take them
+    int32_t size;
+    int32_t pinned;
+
+    // spinlock to protect the run queue from stealers
+    irq_spinlock_t lock;
+} run_queue_t;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Control scheduling
@@ -15,12 +63,87 @@
  */
 void scheduler_ready_task(task_t* task);
 
+/**
+ * Put a chain of tasks into a ready state, the chain is linked by the sched
+ * link of the tasks and is consumed, each cpu that gets tasks out of it is
+ * only woken once
+ *
+ * @param list    [IN] The first task of the chain
+ */
+void scheduler_ready_tasks(task_t* list);
+
+/**
+ * Set the priority of the current task, takes effect
+ * the next time it is put in a run queue
+ *
+ * @param priority  [IN] The new priority, lower is more important
+ */
+err_t scheduler_set_priority(uint32_t priority);
+
+/**
+ * Recalculate the effective priority of a task after its base or boost
+ * priority changed, moving it in its run queue if it is in one, must be
+ * called with the boost lock of the task held
+ *
+ * @param task      [IN] The task, can be in any state
+ */
+void scheduler_update_priority(task_t* task);
+
+/**
+ * Set the cpus the current task may run on, the cpus outside of CPU_COUNT
+ * are ignored, the current task only moves once it is rescheduled
+ *
+ * @param affinity  [IN] Bitmask of the cpus, must have at least one valid cpu
+ */
+err_t scheduler_set_affinity(uint32_t affinity);
+
+/**
+ * Limit the cpu time of the current task to budget microseconds every period,
+ * a task that used up its budget is throttled until the next period, only
+ * applies to the normal class
+ *
+ * @param period    [IN] The period, zero to remove the quota
+ * @param budget    [IN] The budget in each period
+ */
+err_t scheduler_set_quota(uint32_t period, uint32_t budget);
+
+/**
+ * Move the current task to the EDF class, the task is going to get budget
+ * microseconds of cpu time every period, which must be used before the
+ * deadline of each job. The task tells that a job is done by yielding.
+ *
+ * Fails if the task can't be admitted without going over the capacity
+ * of the cpus. A zero period moves the task back to the normal class.
+ *
+ * @param period    [IN] The period of the jobs
+ * @param budget    [IN] The cpu time of each job
+ * @param deadline  [IN] The deadline of each job, relative to its release
+ */
+err_t scheduler_set_edf(uint32_t period, uint32_t budget, uint32_t deadline);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Take a snapshot of the scheduler statistics, the format is described
+ * in stats.h, tasks that don't fit in the buffer are left out
+ *
+ * @param buffer    [IN] The buffer to write to, must be 8 byte aligned
+ * @param size      [IN] The size of the buffer
+ * @param written   [OUT] The amount of bytes written
+ */
+err_t scheduler_get_stats(void* buffer, size_t size, size_t* written);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Preemption stuff
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
  * Disable preemption, nestable
+ *
+ * The kernel runs with all interrupts masked, so no tick can come in while
+ * it is disabled, it only keeps scheduler_yield from switching away
  */
 void scheduler_preempt_disable(void);
 
@@ -35,8 +158,27 @@ void scheduler_preempt_enable(void);
 
 void scheduler_on_schedule(task_regs_t* regs);
 
+void scheduler_on_yield(task_regs_t* regs);
+
+/**
+ * Switch directly to the given task, giving it the rest of our timeslice,
+ * on failure nothing is changed and the current task keeps running
+ *
+ * @param regs  [IN] The context of the current task
+ * @param pid   [IN] The pid of the task to switch to
+ */
+err_t scheduler_on_yield_to(task_regs_t* regs, pid_t pid);
+
 void scheduler_on_park(task_regs_t* regs);
 
+/**
+ * Park the current task until the given amount of time has passed
+ *
+ * @param regs  [IN] The context of the current task
+ * @param us    [IN] The time to sleep, in microseconds
+ */
+void scheduler_on_sleep(task_regs_t* regs, uint32_t us);
+
 void scheduler_on_drop(task_regs_t* regs);
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1,20 +1,33 @@
 #include "task.h"
 #include "syscall.h"
 #include "scheduler.h"
+#include "mutex.h"
+#include "futex.h"
 #include "mem/umem.h"
+#include "arch/cpu.h"
+#include "arch/intrin.h"
+
+// the fast path in syscall_entry has its own copy of these
+STATIC_ASSERT(SYSCALL_FAST_GET_PID == SYSCALL_GET_PID);
+STATIC_ASSERT(SYSCALL_FAST_GET_CYCLES == SYSCALL_GET_CYCLES);
+STATIC_ASSERT(SYSCALL_FAST_GET_CPU == SYSCALL_GET_CPU);
 
 static err_t get_user_ptr(uintptr_t user_ptr, size_t user_size, void** ptr) {
     err_t err = NO_ERROR;
 
-    // TODO: check no page boundary crossing
-    // TODO: check in the range
+    // must be inside of the data space, and not cross a page
+    // boundary since the next page can be anywhere physically
+    uintptr_t offset = user_ptr % USER_PAGE_SIZE;
+    CHECK_ERROR(USER_DATA_BASE <= user_ptr && user_ptr < USER_DATA_BASE + MAX_PAGE_COUNT * USER_PAGE_SIZE, ERROR_INVALID_PTR);
+    CHECK_ERROR(user_size <= USER_PAGE_SIZE - offset, ERROR_INVALID_PTR);
 
     // convert by getting the page index and
     // convert it to the physical index,
     // converting back to a full address
     task_t* task = get_current_task();
-    int idx = DATA_PAGE_INDEX(user_ptr);
-    *ptr = (void*)DATA_PAGE_ADDR(task->mmu.dmmu.entries[idx].phys);
+    page_entry_t* entry = &task->mmu.dmmu.entries[DATA_PAGE_INDEX(user_ptr)];
+    CHECK_ERROR(entry->type == PAGE_MAPPED, ERROR_INVALID_PTR);
+    *ptr = (void*)(DATA_PAGE_ADDR(entry->phys) + offset);
 
 cleanup:
     return err;
@@ -31,10 +44,84 @@ void common_syscall_handler(task_regs_t* regs) {
     switch (syscall_num) {
         // scheduling related syscalls
         case SYSCALL_SCHED_PARK: scheduler_on_park(regs); break;
-        case SYSCALL_SCHED_YIELD: scheduler_on_schedule(regs); break;
+        case SYSCALL_SCHED_YIELD: scheduler_on_yield(regs); break;
         case SYSCALL_SCHED_DROP: scheduler_on_drop(regs); break;
+        case SYSCALL_SLEEP: scheduler_on_sleep(regs, regs->ar[SYSCALL_ARG1]); break;
+        case SYSCALL_SCHED_SET_PRIORITY: {
+            uint8_t old_priority = get_current_task()->priority;
+            CHECK_AND_RETHROW(scheduler_set_priority(regs->ar[SYSCALL_ARG1]));
+
+            // if we lowered our priority someone else might be more important now
+            if (get_current_task()->priority > old_priority) {
+                scheduler_on_schedule(regs);
+            }
+        } break;
+        case SYSCALL_SCHED_SET_AFFINITY: {
+            CHECK_AND_RETHROW(scheduler_set_affinity(regs->ar[SYSCALL_ARG1]));
+
+            // we might not be allowed on this cpu anymore
+            if (!(get_current_task()->affinity & (1 << get_cpu_index()))) {
+                scheduler_on_schedule(regs);
+            }
+        } break;
+        case SYSCALL_SCHED_YIELD_TO: CHECK_AND_RETHROW(scheduler_on_yield_to(regs, regs->ar[SYSCALL_ARG1])); break;
+        case SYSCALL_SCHED_SET_QUOTA: {
+            CHECK_AND_RETHROW(scheduler_set_quota(regs->ar[SYSCALL_ARG1], regs->ar[SYSCALL_ARG2]));
+
+            // reschedule so the new budget is enforced by the timer
+            scheduler_on_schedule(regs);
+        } break;
+        case SYSCALL_SCHED_SET_EDF: {
+            CHECK_AND_RETHROW(scheduler_set_edf(regs->ar[SYSCALL_ARG1], regs->ar[SYSCALL_ARG2], regs->ar[SYSCALL_ARG3]));
+
+            // we might have moved to another cpu, or just got
+            // more important than the rest, reschedule
+            scheduler_on_schedule(regs);
+        } break;
+
+        // mutexes
+        case SYSCALL_MUTEX_CREATE: {
+            int handle = -1;
+            CHECK_AND_RETHROW(kmutex_create(&handle));
+            regs->ar[SYSCALL_RET] = handle;
+        } break;
+        case SYSCALL_MUTEX_DESTROY: CHECK_AND_RETHROW(kmutex_destroy(regs->ar[SYSCALL_ARG1])); break;
+        case SYSCALL_MUTEX_LOCK: CHECK_AND_RETHROW(kmutex_on_lock(regs, regs->ar[SYSCALL_ARG1])); break;
+        case SYSCALL_MUTEX_UNLOCK: CHECK_AND_RETHROW(kmutex_on_unlock(regs, regs->ar[SYSCALL_ARG1])); break;
+
+        // futexes
+        case SYSCALL_FUTEX_WAIT: {
+            // resolve arguments
+            void* addr = NULL;
+            CHECK_AND_RETHROW(get_user_ptr(regs->ar[SYSCALL_ARG1], sizeof(uint32_t), &addr));
+
+            CHECK_AND_RETHROW(futex_on_wait(regs, addr, regs->ar[SYSCALL_ARG2], regs->ar[SYSCALL_ARG3]));
+        } break;
+        case SYSCALL_FUTEX_WAKE: {
+            // resolve arguments
+            void* addr = NULL;
+            CHECK_AND_RETHROW(get_user_ptr(regs->ar[SYSCALL_ARG1], sizeof(uint32_t), &addr));
+
+            uint32_t woken = 0;
+            CHECK_AND_RETHROW(futex_wake(addr, regs->ar[SYSCALL_ARG2], &woken));
+            regs->ar[SYSCALL_RET] = woken;
+        } break;
 
         // misc syscalls
+        case SYSCALL_GET_PID: regs->ar[SYSCALL_RET] = get_current_task()->pid; break;
+        case SYSCALL_GET_CYCLES: regs->ar[SYSCALL_RET] = __ccount(); break;
+        case SYSCALL_GET_CPU: regs->ar[SYSCALL_RET] = get_cpu_index(); break;
+        case SYSCALL_SCHED_STATS: {
+            // resolve arguments
+            void* buffer = NULL;
+            size_t size = regs->ar[SYSCALL_ARG2];
+            CHECK_AND_RETHROW(get_user_ptr(regs->ar[SYSCALL_ARG1], size, &buffer));
+
+            // take the snapshot
+            size_t written = 0;
+            CHECK_AND_RETHROW(scheduler_get_stats(buffer, size, &written));
+            regs->ar[SYSCALL_RET] = written;
+        } break;
         case SYSCALL_LOG: {
             // resolve arguments
             void* str_ptr = NULL;
@@ -1,8 +1,10 @@
 #pragma once
 
+#ifndef __ASSEMBLER__
 #include <stdint.h>
 
 #include <syscall.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Syscalls ABI
@@ -17,3 +19,14 @@
 #define SYSCALL_ARG4    5
 #define SYSCALL_ARG5    8
 #define SYSCALL_ARG6    9
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Fast syscalls
+//
+// These are served by syscall_entry right away, using only the registers that the entry already saved,
+// they must never block or switch tasks. The numbers must match syscall_t, which assembly can't include.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define SYSCALL_FAST_GET_PID        0x0e
+#define SYSCALL_FAST_GET_CYCLES     0x18
+#define SYSCALL_FAST_GET_CPU        0x1b
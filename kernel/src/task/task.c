@@ -2,8 +2,11 @@
 #include "mem/umem.h"
 #include "vdso/vdso.h"
 #include "drivers/pid.h"
+#include "arch/cpu.h"
 
 #include <util/string.h>
+#include <util/spinlock.h>
+#include <syscall.h>
 
 #include <stddef.h>
 #include <stdbool.h>
@@ -22,6 +25,7 @@ static reg_offset_t m_reg_offsets[] = {
     { "WINDOWBASE", offsetof(task_regs_t, windowbase) },
     { "WINDOWSTART", offsetof(task_regs_t, windowstart) },
     { "PS", offsetof(task_regs_t, ps) },
+    { "SCOMPARE1", offsetof(task_regs_t, scompare1) },
 };
 
 void task_regs_dump(task_regs_t* regs) {
@@ -79,6 +83,12 @@ void task_regs_dump(task_regs_t* regs) {
 
 static pid_t m_pid_gen = 0;
 
+// all the tasks in the system, new ones are added to the head
+static task_t* m_all_tasks = NULL;
+
+// spinlock to protect the task list
+static irq_spinlock_t m_all_tasks_lock = INIT_NAMED_IRQ_SPINLOCK("tasks");
+
 task_t* create_task(void* entry, const char* fmt, ...) {
     // allocate the memory
     task_t* task = malloc(sizeof(task_t));
@@ -89,9 +99,15 @@ task_t* create_task(void* entry, const char* fmt, ...) {
     // zero it out
     memset(task, 0, sizeof(task_t));
     task->status = TASK_STATUS_DEAD;
+    task->ref_count = 1;
 
     // initialize the uctx
     task->pid = m_pid_gen++;
+    task->priority = SCHED_PRIORITY_DEFAULT;
+    task->base_priority = SCHED_PRIORITY_DEFAULT;
+    task->boost_priority = SCHED_PRIORITY_COUNT;
+    task->affinity = CPU_AFFINITY_ALL;
+    task->fpu_cpu = -1;
 
     // allocate the uctx
     int uctx_page = umem_alloc_data_page();
@@ -127,11 +143,52 @@ task_t* create_task(void* entry, const char* fmt, ...) {
     // set the state as waiting
     cas_task_state(task, TASK_STATUS_DEAD, TASK_STATUS_WAITING);
 
+    // make it visible to everyone
+    irq_spinlock_lock(&m_all_tasks_lock);
+    task->all_link = m_all_tasks;
+    m_all_tasks = task;
+    irq_spinlock_unlock(&m_all_tasks_lock);
+
     return task;
 }
 
+task_t* get_task_by_pid(pid_t pid) {
+    task_t* task;
+
+    irq_spinlock_lock(&m_all_tasks_lock);
+    for (task = m_all_tasks; task != NULL; task = task->all_link) {
+        if (task->pid == pid) {
+            break;
+        }
+    }
+
+    // take the reference while the task can't go away, unless
+    // the last one is already gone and it is about to be freed
+    if (task != NULL) {
+        int32_t count = atomic_load(&task->ref_count);
+        do {
+            if (count == 0) {
+                task = NULL;
+                break;
+            }
+        } while (!atomic_compare_exchange_weak(&task->ref_count, &count, count + 1));
+    }
+    irq_spinlock_unlock(&m_all_tasks_lock);
+
+    return task;
+}
+
+task_t* get_next_task(task_t* task) {
+    if (task == NULL) {
+        return m_all_tasks;
+    }
+    return task->all_link;
+}
+
 void release_task(task_t* task) {
-    ASSERT(!"TODO: release_task");
+    if (atomic_fetch_sub(&task->ref_count, 1) == 1) {
+        ASSERT(!"TODO: free the task");
+    }
 }
 
 task_status_t get_task_status(task_t* thread) {
@@ -159,13 +216,18 @@ void cas_task_state(task_t* task, task_status_t old, task_status_t new) {
     }
 }
 
-void save_task_context(task_t* task, task_regs_t* regs) {
-    task->ucontext->regs = *regs;
-}
+// the frames that exceptions spill to while there is no task on the
+// cpu, which only happens when the cpu first drops into the scheduler
+static task_regs_t m_boot_frames[CPU_COUNT];
+
+task_regs_t* g_exception_frames[CPU_COUNT] = {
+    &m_boot_frames[0],
+    &m_boot_frames[1],
+};
 
-void restore_task_context(task_t* task, task_regs_t* regs) {
-    // copy the registers
-    *regs = task->ucontext->regs;
+void restore_task_context(task_t* task) {
+    // the next exception spills right into the task
+    g_exception_frames[get_cpu_index()] = &task->ucontext->regs;
 
     // activate the mmu entry
     mmu_activate(&task->mmu);
@@ -4,9 +4,13 @@
 #include <mem/mem.h>
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "task_regs.h"
+#include "timer.h"
 #include "arch/intrin.h"
 
+#include <stats.h>
+
 /**
  * Represents a pid, we are going to limit
  * to 255 because it is more than we are going
@@ -81,8 +85,8 @@ typedef struct task_regs {
     uint32_t windowbase;    // 280
     uint32_t windowstart;   // 284
     uint16_t windowmask;    // 288
-    uint16_t windowsize;    // 190
-    // TODO: save scompare1 (used by atomic operations which userspace might do)
+    uint16_t windowsize;    // 290
+    uint32_t scompare1;     // 292
 } task_regs_t;
 STATIC_ASSERT(offsetof(task_regs_t, sar) == TASK_REGS_SAR);
 STATIC_ASSERT(offsetof(task_regs_t, lbeg) == TASK_REGS_LBEG);
@@ -93,6 +97,7 @@ STATIC_ASSERT(offsetof(task_regs_t, ps) == TASK_REGS_PS);
 STATIC_ASSERT(offsetof(task_regs_t, windowbase) == TASK_REGS_WINDOWBASE);
 STATIC_ASSERT(offsetof(task_regs_t, windowstart) == TASK_REGS_WINDOWSTART);
 STATIC_ASSERT(offsetof(task_regs_t, windowmask) == TASK_REGS_WINDOWMASK);
+STATIC_ASSERT(offsetof(task_regs_t, scompare1) == TASK_REGS_SCOMPARE1);
 STATIC_ASSERT(sizeof(task_regs_t) == TASK_REGS_SIZE);
 
 void task_regs_dump(task_regs_t* regs);
@@ -116,13 +121,88 @@ typedef struct task_ucontext {
     // the task name
     char name[64];
 
-    // the registers of this thread, we don't care about storing them in this
-    // page instead of the kernel heap because it is going to be saved on every
-    // context switch anyways, and it might be a cool way to do exception handling
+    // the registers of this thread, the exception entry spills them right in
+    // here so a context switch never has to copy them, and it might be a cool
+    // way to do exception handling
     task_regs_t regs;
 } PACKED task_ucontext_t;
 STATIC_ASSERT(sizeof(task_ucontext_t) <= USER_PAGE_SIZE);
 
+/**
+ * The scheduling class of a task
+ */
+typedef enum sched_class {
+    /**
+     * Scheduled by priority, round-robin inside the same priority
+     */
+    SCHED_CLASS_NORMAL = 0,
+
+    /**
+     * Periodic task scheduled by earliest deadline first, these always
+     * come before normal tasks
+     */
+    SCHED_CLASS_EDF = 1,
+} sched_class_t;
+
+/**
+ * The state of an EDF task, all times are in microseconds
+ */
+typedef struct task_edf {
+    // the parameters the task asked for
+    uint32_t period;
+    uint32_t budget;
+    uint32_t deadline;
+
+    // the bandwidth this task takes from its cpu
+    uint32_t bw;
+
+    // the absolute deadline of the current job
+    uint64_t abs_deadline;
+
+    // the start of the next job
+    uint64_t next_release;
+
+    // how much of the budget is left for the current job
+    int32_t remaining;
+
+    // the cpu the task was admitted to
+    uint8_t cpu;
+
+    // the current job has completed
+    bool done;
+
+    // the current job was already counted as a miss
+    bool missed;
+} task_edf_t;
+
+/**
+ * The cpu quota of a normal task, all the times are in microseconds
+ */
+typedef struct task_quota {
+    // the parameters the task asked for, the
+    // period is zero if there is no quota
+    uint32_t period;
+    uint32_t budget;
+
+    // how much of the budget is left for the current period
+    int32_t remaining;
+
+    // when the current period ends
+    uint64_t period_end;
+
+    // wakes the task once it is throttled
+    timer_t refill_timer;
+} task_quota_t;
+
+/**
+ * The state of the fpu (coprocessor 0), only saved for tasks that use it
+ */
+typedef struct task_fpu {
+    uint32_t f[16];
+    uint32_t fcr;
+    uint32_t fsr;
+} task_fpu_t;
+
 /**
  * The task struct, used to represent a single task
  */
@@ -138,9 +218,79 @@ typedef struct task {
     // The current status of the task
     task_status_t status;
 
+    // the references to the task, the scheduler has one from the
+    // moment the task is created until it is dropped
+    int32_t ref_count;
+
+    // the priority of the task, lower is more important, this is the
+    // effective one, the base is what the task asked for and the boost
+    // is what it inherited from the tasks waiting on its mutexes
+    uint8_t priority;
+    uint8_t base_priority;
+    uint8_t boost_priority;
+
+    // serializes changes to the effective priority, the seq is bumped
+    // on every boost so a recalculation can tell if it raced with one
+    irq_spinlock_t boost_lock;
+    uint32_t boost_seq;
+
+    // the level of the run queue the task is waiting in
+    uint8_t queue_level;
+
+    // bitmask of the cpus the task may run on, a task that can't run on
+    // all the cpus is pinned to the local run queues of its cpus
+    uint32_t affinity;
+
+    // the scheduling class, and the state of the
+    // edf class if the task is in it
+    sched_class_t sched_class;
+    task_edf_t edf;
+
+    // the cpu quota, only for the normal class
+    task_quota_t quota;
+
     // Link for the scheduler
     struct task* sched_link;
 
+    // Link in the wakeup list of a cpu
+    struct task* wake_link;
+
+    // the run queue the task is in, NULL if it is not in any,
+    // protected by the lock of the run queue
+    struct run_queue* run_queue;
+
+    // Link in the list of all the tasks
+    struct task* all_link;
+
+    // the accounting of the task, the stamp is the CCOUNT of when
+    // the task became runnable, and woken is set if it was readied
+    // from a waiting state
+    task_stats_t stats;
+    uint32_t ready_stamp;
+    bool woken;
+
+    // used to wake the task when it sleeps, and for the timeout of a
+    // futex wait, a task only does one of them at a time and the timer
+    // is never armed again before its callback ran, since the callback
+    // is always the one that readies the task once it expired
+    timer_t sleep_timer;
+
+    // the mutexes the task holds, and the one it waits on
+    struct kmutex* held_mutexes;
+    struct kmutex* blocked_on;
+
+    // the futex the task waits on, the address stays after the wait so
+    // a late timeout can still find the bucket, waiting is what counts,
+    // and if the wait armed the sleep timer for its timeout
+    uint32_t* futex_addr;
+    bool futex_waiting;
+    bool futex_timed;
+
+    // the fpu state of the task, and the cpu whose fpu still
+    // holds it, -1 if it is only in the saved state
+    task_fpu_t fpu;
+    int8_t fpu_cpu;
+
     // The user context of the thread, contains
     // the registers as well
     task_ucontext_t* ucontext;
@@ -148,8 +298,30 @@ typedef struct task {
 
 task_t* create_task(void* entry_point, const char* fmt, ...);
 
+/**
+ * Release a reference to the task
+ *
+ * @param task  [IN] The task
+ */
 void release_task(task_t* task);
 
+/**
+ * Find a task by its pid, the caller gets a reference to the
+ * task and must release it once done
+ *
+ * @param pid   [IN] The pid of the task
+ * @returns The task, NULL if there is no such task
+ */
+task_t* get_task_by_pid(pid_t pid);
+
+/**
+ * Iterate over all the tasks in the system
+ *
+ * @param task  [IN] The previous task, NULL to get the first one
+ * @returns The next task, NULL if there are no more tasks
+ */
+task_t* get_next_task(task_t* task);
+
 #define SAFE_RELEASE_TASK(task) \
     do { \
         if (task != NULL) { \
@@ -186,6 +358,15 @@ void cas_task_state(task_t* task, task_status_t old, task_status_t new);
 // Task context
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void save_task_context(task_t* task, task_regs_t* regs);
+/**
+ * The task_regs_t that the exception entries of each cpu spill the context
+ * into and restore it from, this is the ucontext of the task running on the
+ * cpu, so there is no need to copy the registers around on a switch
+ */
+extern task_regs_t* g_exception_frames[];
 
-void restore_task_context(task_t* task, task_regs_t* regs);
+/**
+ * Make the task the one that is restored once we return from the exception,
+ * and the one that the next exception is going to be saved into
+ */
+void restore_task_context(task_t* task);
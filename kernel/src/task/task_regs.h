@@ -12,4 +12,5 @@
 #define TASK_REGS_WINDOWSTART   284
 #define TASK_REGS_WINDOWMASK    288
 #define TASK_REGS_WINDOWSIZE    290
-#define TASK_REGS_SIZE          292
+#define TASK_REGS_SCOMPARE1     292
+#define TASK_REGS_SIZE          296
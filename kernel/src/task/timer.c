@@ -0,0 +1,306 @@
+#include "timer.h"
+#include "arch/cpu.h"
+#include "drivers/timg.h"
+
+#include <util/except.h>
+
+#include <stddef.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/**
+ * The range of ticks that a whole wheel covers
+ */
+#define TIMER_WHEEL_RANGE (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void lock_wheel(timer_wheel_t* wheel) {
+    irq_spinlock_lock(&wheel->lock);
+}
+
+static void unlock_wheel(timer_wheel_t* wheel) {
+    irq_spinlock_unlock(&wheel->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Wheel management
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Put the timer in the slot that matches how far it is from now
+ */
+static void wheel_insert(timer_wheel_t* wheel, timer_t* timer) {
+    uint64_t expires = timer->expires;
+
+    // already expired, run it on the next tick
+    if (expires < wheel->now) {
+        expires = wheel->now;
+    }
+
+    // too far away, park it at the end of the wheel
+    if (expires - wheel->now >= TIMER_WHEEL_RANGE) {
+        expires = wheel->now + TIMER_WHEEL_RANGE - 1;
+    }
+
+    // find the first level that can hold it
+    uint64_t delta = expires - wheel->now;
+    int level = 0;
+    while (delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    // link it at the head of the slot
+    timer_t** head = &wheel->slots[level][slot];
+    timer->next = *head;
+    if (timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+
+    wheel->occupied[level] |= 1ull << slot;
+}
+
+static void wheel_remove(timer_wheel_t* wheel, timer_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+
+    // the timer was the last in the slot, find the slot by its head pointer
+    // since we don't know the level and slot, expired timers that are about
+    // to run are not in any slot
+    if (*timer->pprev == NULL && timer->pprev >= &wheel->slots[0][0] && timer->pprev <= &wheel->slots[TIMER_WHEEL_LEVELS - 1][TIMER_WHEEL_MASK]) {
+        int index = timer->pprev - &wheel->slots[0][0];
+        wheel->occupied[index / TIMER_WHEEL_SLOTS] &= ~(1ull << (index % TIMER_WHEEL_SLOTS));
+    }
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/**
+ * Move all the timers in a slot of a higher level to the lower levels
+ */
+static void wheel_cascade(timer_wheel_t* wheel, int level) {
+    int slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    timer_t* timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ull << slot);
+
+    while (timer != NULL) {
+        timer_t* next = timer->next;
+        wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+/**
+ * Get the first occupied slot from the given index onwards, wrapping
+ * around, as the distance from the index
+ */
+static int next_occupied(uint64_t occupied, int index) {
+    uint64_t rotated = (occupied >> index) | (index == 0 ? 0 : occupied << (TIMER_WHEEL_SLOTS - index));
+    return __builtin_ctzll(rotated);
+}
+
+/**
+ * Find the slot of a level that is going to be handled first, for the lowest
+ * level that is when its timers expire, and for the higher ones it is when
+ * it cascades, which is on the first tick that is on the granularity of the
+ * level and indexes it, the current tick counts since it was not processed yet
+ *
+ * @param slot  [OUT] The slot
+ * @returns The tick the slot is handled on, UINT64_MAX if the level is empty
+ */
+static uint64_t wheel_next_slot(timer_wheel_t* wheel, int level, int* slot) {
+    uint64_t occupied = wheel->occupied[level];
+    if (occupied == 0) {
+        return UINT64_MAX;
+    }
+
+    int shift = TIMER_WHEEL_BITS * level;
+    uint64_t granularity = 1ull << shift;
+    uint64_t boundary = (wheel->now + granularity - 1) & ~(granularity - 1);
+    int index = (boundary >> shift) & TIMER_WHEEL_MASK;
+    int distance = next_occupied(occupied, index);
+
+    *slot = (index + distance) & TIMER_WHEEL_MASK;
+    return boundary + distance * granularity;
+}
+
+/**
+ * Get the next tick that the wheel has anything to do on, either
+ * expiring timers or cascading them, UINT64_MAX if it is empty
+ */
+static uint64_t wheel_next_tick(timer_wheel_t* wheel) {
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int slot;
+        uint64_t tick = wheel_next_slot(wheel, level, &slot);
+        if (tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Timer api
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void timer_init(timer_t* timer, void (*callback)(void* arg), void* arg) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->wheel = NULL;
+}
+
+void timer_add(timer_t* timer, uint64_t deadline) {
+    timer_wheel_t* wheel = &get_cpu_context()->timer_wheel;
+
+    ASSERT(timer->wheel == NULL);
+
+    // round up, so we never expire early
+    timer->expires = (deadline + TIMER_TICK_US - 1) / TIMER_TICK_US;
+
+    lock_wheel(wheel);
+
+    // the wheel is not advanced while it is empty, catch up
+    // so the timer will not need to go through the old ticks
+    if (wheel->count == 0) {
+        uint64_t now = systimer_now() / TIMER_TICK_US;
+        if (wheel->now < now) {
+            wheel->now = now;
+        }
+    }
+
+    wheel_insert(wheel, timer);
+    timer->wheel = wheel;
+    wheel->count++;
+    unlock_wheel(wheel);
+}
+
+bool timer_cancel(timer_t* timer) {
+    timer_wheel_t* wheel = timer->wheel;
+    if (wheel == NULL) {
+        return false;
+    }
+
+    lock_wheel(wheel);
+
+    // make sure it did not expire while we took the lock
+    bool armed = timer->wheel == wheel;
+    if (armed) {
+        wheel_remove(wheel, timer);
+        timer->wheel = NULL;
+        wheel->count--;
+    }
+
+    unlock_wheel(wheel);
+
+    return armed;
+}
+
+void timers_run(uint64_t now) {
+    timer_wheel_t* wheel = &get_cpu_context()->timer_wheel;
+    uint64_t target = now / TIMER_TICK_US;
+
+    // nothing to do, skip ahead without the lock
+    if (wheel->count == 0) {
+        if (wheel->now <= target) {
+            wheel->now = target + 1;
+        }
+        return;
+    }
+
+    lock_wheel(wheel);
+
+    while (wheel->now <= target) {
+        // nothing is left, no need to go over the empty ticks
+        if (wheel->count == 0) {
+            wheel->now = target + 1;
+            break;
+        }
+
+        // skip right to the next tick that has anything on it, a
+        // long sleep should not cost us a pass over every tick
+        uint64_t next = wheel_next_tick(wheel);
+        if (next > target) {
+            wheel->now = target + 1;
+            break;
+        }
+        wheel->now = next;
+
+        // once a level wraps around cascade the next slot of the level
+        // above it, stopping at the first level that did not wrap
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (((wheel->now >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) != 0) {
+                break;
+            }
+            wheel_cascade(wheel, level);
+        }
+
+        // take all the expired timers of this tick, they are still
+        // armed so they can be cancelled until we get to them
+        int slot = wheel->now & TIMER_WHEEL_MASK;
+        timer_t* expired = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~(1ull << slot);
+        if (expired != NULL) {
+            expired->pprev = &expired;
+        }
+        wheel->now++;
+
+        // and run them, they might want to take locks or re-arm
+        // themselves so we can't hold the lock while doing so
+        while (expired != NULL) {
+            timer_t* timer = expired;
+            wheel_remove(wheel, timer);
+            timer->wheel = NULL;
+            wheel->count--;
+
+            unlock_wheel(wheel);
+            timer->callback(timer->arg);
+            lock_wheel(wheel);
+        }
+    }
+
+    unlock_wheel(wheel);
+}
+
+uint64_t timers_next_event() {
+    timer_wheel_t* wheel = &get_cpu_context()->timer_wheel;
+
+    if (wheel->count == 0) {
+        return UINT64_MAX;
+    }
+
+    // the lowest level only holds timers that are less than
+    // a rotation away so its next slot is exact
+    int slot;
+    uint64_t next = wheel_next_slot(wheel, 0, &slot);
+
+    // a slot of a higher level only holds timers that expire between
+    // its cascade and the cascade of the slot after it, so the earliest
+    // timer is in the first slot of one of the levels, and when we wake
+    // up for it the cascades on the way are done by the same run
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t cascade = wheel_next_slot(wheel, level, &slot);
+        if (cascade >= next) {
+            continue;
+        }
+
+        for (timer_t* timer = wheel->slots[level][slot]; timer != NULL; timer = timer->next) {
+            uint64_t expires = timer->expires < cascade ? cascade : timer->expires;
+            if (expires < next) {
+                next = expires;
+            }
+        }
+    }
+
+    return next == UINT64_MAX ? UINT64_MAX : next * TIMER_TICK_US;
+}
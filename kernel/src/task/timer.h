@@ -0,0 +1,102 @@
+#pragma once
+
+#include <util/spinlock.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * The resolution of the timers, in microseconds
+ */
+#define TIMER_TICK_US 1000
+
+/**
+ * The timer wheel has 4 levels of 64 slots each, every level has a
+ * granularity of 64 times the one below it, so the wheel covers
+ * 2^24 ticks (about 4.5 hours), timers that are further away are
+ * parked at the last slot and cascade down from there
+ */
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+
+/**
+ * A single timer, the callback is called from the scheduler of the cpu
+ * that armed the timer, with the timer already disarmed
+ */
+typedef struct timer {
+    // the links in the slot, pprev allows for O(1) removal
+    struct timer* next;
+    struct timer** pprev;
+
+    // the tick that the timer expires on
+    uint64_t expires;
+
+    // what to do once it expires
+    void (*callback)(void* arg);
+    void* arg;
+
+    // the wheel the timer is on, NULL if not armed
+    struct timer_wheel* wheel;
+} timer_t;
+
+/**
+ * The timer wheel, each cpu has its own one
+ */
+typedef struct timer_wheel {
+    // the timers, per level and per slot
+    timer_t* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    // bitmap of the slots that have timers in them
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+
+    // the next tick that needs to be processed
+    uint64_t now;
+
+    // the amount of armed timers
+    uint32_t count;
+
+    // spinlock to protect the wheel from other cpus cancelling timers
+    irq_spinlock_t lock;
+} timer_wheel_t;
+
+/**
+ * Initialize a timer
+ *
+ * @param timer     [IN] The timer
+ * @param callback  [IN] The callback to call once the timer expires
+ * @param arg       [IN] The argument to the callback
+ */
+void timer_init(timer_t* timer, void (*callback)(void* arg), void* arg);
+
+/**
+ * Arm a timer on the wheel of the current cpu, the timer must not be armed
+ *
+ * @param timer     [IN] The timer
+ * @param deadline  [IN] The time to expire on, in microseconds of the system timer
+ */
+void timer_add(timer_t* timer, uint64_t deadline);
+
+/**
+ * Disarm a timer, can be called from any cpu
+ *
+ * @param timer     [IN] The timer
+ * @returns true if the timer was armed, false if it already expired
+ */
+bool timer_cancel(timer_t* timer);
+
+/**
+ * Run all the expired timers of the current cpu
+ *
+ * @param now       [IN] The current time, in microseconds of the system timer
+ */
+void timers_run(uint64_t now);
+
+/**
+ * Get the time of the next timer expiry of the current cpu, a timer on a
+ * higher level of the wheel is cascaded by the same run that expires it,
+ * so there is no need to wake up for the cascades on their own
+ *
+ * @returns The time in microseconds of the system timer, UINT64_MAX if there are no timers
+ */
+uint64_t timers_next_event();
@@ -38,14 +38,13 @@ typedef char symbol_t[];
         __res; \
     })
 
+/**
+ * Iterate over the indexes of the set bits of num, up to 64 bits, num
+ * itself is not changed, a break only skips to the next bit
+ */
 #define FOR_EACH_BIT(num, it) \
-    if (num != 0) \
-        for( \
-            int it = __builtin_ffs(num); \
-            num; \
-            num &= ~it, \
-            it = __builtin_ffs(num) \
-        )
+    for (uint64_t _bits_##it = (num); _bits_##it != 0; _bits_##it &= _bits_##it - 1) \
+        for (int it = __builtin_ctzll(_bits_##it), _once_##it = 1; _once_##it; _once_##it = 0)
 
 #define  BIT0     0x00000001
 #define  BIT1     0x00000002
@@ -28,6 +28,16 @@ typedef enum err {
      * The given syscall was invalid
      */
     ERROR_INVALID_SYSCALL,
+
+    /**
+     * The requested object does not exist
+     */
+    ERROR_NOT_FOUND,
+
+    /**
+     * The object is not in a state that allows the operation
+     */
+    ERROR_NOT_READY,
 } err_t;
 
 #define IS_ERROR(x) ((x) != 0)
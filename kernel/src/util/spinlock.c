@@ -0,0 +1,81 @@
+#include "spinlock.h"
+
+#include <arch/intrin.h>
+
+#include <stddef.h>
+
+#ifdef SPINLOCK_STATS
+
+// all the named locks that were ever taken, only pushed to
+static irq_spinlock_t* volatile m_spinlocks = NULL;
+
+static void register_spinlock(irq_spinlock_t* lock) {
+    // we hold the lock so no one else can register it
+    lock->registered = true;
+
+    uint32_t head;
+    do {
+        head = (uint32_t)m_spinlocks;
+        lock->stats_link = (irq_spinlock_t*)head;
+        __memw();
+    } while (__s32c1i((volatile uint32_t*)&m_spinlocks, head, (uint32_t)lock) != head);
+}
+
+#endif
+
+void irq_spinlock_lock(irq_spinlock_t* lock) {
+    uint32_t ps = __rsil15();
+
+    // take a ticket
+    uint32_t ticket;
+    do {
+        ticket = lock->next_ticket;
+    } while (__s32c1i(&lock->next_ticket, ticket, ticket + 1) != ticket);
+
+#ifdef SPINLOCK_STATS
+    bool contended = lock->now_serving != ticket;
+    uint32_t spin_start = __ccount();
+#endif
+
+    // wait for our turn
+    while (lock->now_serving != ticket) {
+        // only read, this keeps the bus free for the owner
+        __memw();
+    }
+    __memw();
+
+    lock->saved_ps = ps;
+
+#ifdef SPINLOCK_STATS
+    if (!lock->registered && lock->name != NULL) {
+        register_spinlock(lock);
+    }
+    lock->acquisitions++;
+    if (contended) {
+        lock->contended++;
+        lock->spin_cycles += __ccount() - spin_start;
+    }
+#endif
+}
+
+void irq_spinlock_unlock(irq_spinlock_t* lock) {
+    uint32_t ps = lock->saved_ps;
+
+    // make sure everything done under the lock is visible
+    // before the next owner gets it
+    __memw();
+    lock->now_serving = lock->now_serving + 1;
+
+    __restore_ps(ps);
+}
+
+irq_spinlock_t* get_next_spinlock(irq_spinlock_t* lock) {
+#ifdef SPINLOCK_STATS
+    if (lock == NULL) {
+        return m_spinlocks;
+    }
+    return lock->stats_link;
+#else
+    return NULL;
+#endif
+}
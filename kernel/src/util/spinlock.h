@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * A ticket spinlock that also masks interrupts while it is held, the tickets
+ * are taken with S32C1I so the lock is fair between the cpus
+ *
+ * When the kernel is built with SPINLOCK_STATS every lock counts how much it
+ * is used and contended, named locks are registered on their first acquisition
+ * so they will show in the stats snapshot, they are never taken off the list
+ * so only locks that live forever may have a name, locks that are embedded in
+ * memory that can be freed must use INIT_IRQ_SPINLOCK
+ */
+typedef struct irq_spinlock {
+    // the next ticket to give, only changed with S32C1I
+    volatile uint32_t next_ticket;
+
+    // the ticket that currently holds the lock
+    volatile uint32_t now_serving;
+
+    // the PS from before the lock was taken, only
+    // touched by the owner of the lock
+    uint32_t saved_ps;
+
+#ifdef SPINLOCK_STATS
+    // the name of the lock, can be NULL
+    const char* name;
+
+    // the counters of the lock, only changed while it is held
+    uint32_t acquisitions;
+    uint32_t contended;
+    uint64_t spin_cycles;
+
+    // link in the list of all the locks
+    struct irq_spinlock* stats_link;
+    bool registered;
+#endif
+} irq_spinlock_t;
+
+#define INIT_IRQ_SPINLOCK() ((irq_spinlock_t){ 0 })
+
+#ifdef SPINLOCK_STATS
+    #define INIT_NAMED_IRQ_SPINLOCK(_name) ((irq_spinlock_t){ .name = (_name) })
+#else
+    #define INIT_NAMED_IRQ_SPINLOCK(_name) INIT_IRQ_SPINLOCK()
+#endif
+
+/**
+ * Take the lock, masking all interrupts until it is released
+ */
+void irq_spinlock_lock(irq_spinlock_t* lock);
+
+/**
+ * Release the lock, restoring the interrupt level from before it was taken
+ */
+void irq_spinlock_unlock(irq_spinlock_t* lock);
+
+/**
+ * Iterate over all the locks that were registered for stats, always
+ * returns NULL when the kernel is built without SPINLOCK_STATS
+ *
+ * @param lock  [IN] The previous lock, NULL to get the first one
+ */
+irq_spinlock_t* get_next_spinlock(irq_spinlock_t* lock);
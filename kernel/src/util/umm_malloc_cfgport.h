@@ -1,3 +1,12 @@
 #pragma once
 
+#include <util/spinlock.h>
 
+/**
+ * The heap is shared between the cpus
+ */
+extern irq_spinlock_t g_umm_lock;
+
+#define UMM_CRITICAL_DECL(tag)
+#define UMM_CRITICAL_ENTRY(tag) irq_spinlock_lock(&g_umm_lock)
+#define UMM_CRITICAL_EXIT(tag)  irq_spinlock_unlock(&g_umm_lock)